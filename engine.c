@@ -1,14 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "sys/time.h"
 #include <ctype.h>
 #include <editline/readline.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <wchar.h>
 
+#ifdef USE_PEXT
+#include <immintrin.h>
+#endif
+
 typedef enum { WHITE, BLACK } side_t;
 
 #define INFINITY 30000
@@ -73,6 +81,14 @@ typedef enum {
   EMPTY,
 } piece_t;
 
+// pieces are laid out white then black in the same order, so a piece's side
+// and the same piece for either side are arithmetic rather than branches
+side_t piece_side(piece_t piece) { return (side_t)(piece >= BLACK_PAWN); }
+
+piece_t side_piece(side_t side, piece_t white_piece) {
+  return (piece_t)(white_piece + side * 6);
+}
+
 // MOVE TYPES
 #define QUIET 0
 #define CAPTURE 1
@@ -92,37 +108,86 @@ const uint8_t QUEEN_PROMOTION = 3;
 typedef uint32_t move_t;
 
 typedef struct {
-  move_t moves[512];
+  move_t moves[256];
   size_t count;
 } move_list_t;
 
+// 16 bytes, so the repetition scan reads four positions per cache line
 typedef struct {
   uint64_t hash;
   uint8_t castle_rights;
-  square_t en_passant_square;
+  uint8_t en_passant_square;
   uint8_t halfmove_clock;
-  piece_t moved_piece;
-  piece_t captured_piece;
+  uint8_t repetition_clock;
+  uint8_t moved_piece;
+  uint8_t captured_piece;
 } history_item_t;
 
+// every position played so far, in the game and then the search. it lives
+// outside board_t so boards stay small and cheap to copy, and grows as needed
+// so long games can't overflow it
+typedef struct {
+  history_item_t *items;
+  int length;
+  int capacity;
+} history_t;
+
+// enough for a long game plus a full depth search before it has to grow
+#define HISTORY_INITIAL_CAPACITY 1024
+
+history_t *history_new() {
+  history_t *history = malloc(sizeof(history_t));
+  history->items = malloc(HISTORY_INITIAL_CAPACITY * sizeof(history_item_t));
+  history->length = 0;
+  history->capacity = HISTORY_INITIAL_CAPACITY;
+  return history;
+}
+
+history_t *history_clone(const history_t *source) {
+  history_t *history = malloc(sizeof(history_t));
+  history->items = malloc(source->capacity * sizeof(history_item_t));
+  memcpy(history->items, source->items,
+         source->length * sizeof(history_item_t));
+  history->length = source->length;
+  history->capacity = source->capacity;
+  return history;
+}
+
+void history_free(history_t *history) {
+  free(history->items);
+  free(history);
+}
+
+void history_push(history_t *history, history_item_t item) {
+  if (history->length == history->capacity) {
+    history->capacity *= 2;
+    history->items =
+        realloc(history->items, history->capacity * sizeof(history_item_t));
+
+    if (history->items == NULL) {
+      printf("Failed to grow the position history\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  history->items[history->length++] = item;
+}
+
+history_item_t history_pop(history_t *history) {
+  return history->items[--history->length];
+}
+
 typedef struct {
-  uint64_t white_pawns;
-  uint64_t white_knights;
-  uint64_t white_bishops;
-  uint64_t white_rooks;
-  uint64_t white_queens;
-  uint64_t white_king;
-
-  uint64_t black_pawns;
-  uint64_t black_knights;
-  uint64_t black_bishops;
-  uint64_t black_rooks;
-  uint64_t black_queens;
-  uint64_t black_king;
+  // one bitboard per piece, indexed by piece_t
+  uint64_t bitboards[12];
 
   uint8_t halfmove_clock;
+  // like the halfmove clock, but a null move resets it too. positions from
+  // before either can't be repeated, so it bounds the repetition scan
+  uint8_t repetition_clock;
 
-  piece_t pieces[64];
+  // piece_t values, stored as bytes to keep the board a few cache lines long
+  uint8_t pieces[64];
 
   uint64_t occupancies[2];
 
@@ -134,8 +199,12 @@ typedef struct {
 
   uint64_t hash;
 
-  history_item_t history[500];
-  int history_length;
+  // evaluation terms per side, kept up to date as pieces are added and removed
+  int material[2];
+  int piece_square_score[2];
+
+  // owned by whoever created the board, copies of a board need their own
+  history_t *history;
 
   int ply;
 } board_t;
@@ -143,122 +212,107 @@ typedef struct {
 #define MAX_SEARCH_DEPTH 64
 const int INFINITE_SEARCH_TIME = -1;
 
+// deepest ply the search can reach once check extensions and quiescence are
+// added on top of the nominal depth
+#define MAX_PLY 128
+
+// worked out once per node, so the generators can emit only legal moves
+typedef struct {
+  square_t king_square;
+  // enemy pieces giving check
+  uint64_t checkers;
+  // our pieces that can only move along the line to our king
+  uint64_t pinned;
+  // squares a non-king move has to land on: anywhere when not in check, the
+  // checker or a square blocking it in single check, nowhere in double check
+  uint64_t check_mask;
+  // every square the enemy attacks, with sliders seeing through our king.
+  // only king moves and castling need it, so it's filled in the first time
+  // one of them asks
+  uint64_t enemy_attacks;
+  bool has_enemy_attacks;
+} legality_t;
+
+// per-ply scratch space, preallocated so the search never touches the heap
+typedef struct {
+  move_list_t move_list;
+  // the checks in the position last searched at this ply, found either by
+  // the node itself or by its parent when deciding whether to reduce the
+  // move. `legality_hash` says which position it belongs to
+  legality_t legality;
+  uint64_t legality_hash;
+  move_t killer_moves[2];
+  move_t current_move;
+} search_stack_t;
+
 typedef struct {
   // uci arguments
   int time_left;
   int moves_to_go;
   int move_time;
   int depth;
+  bool infinite;
 
   // calculated search info
-  bool stopped;
+  // volatile because the main search thread flips it to stop helper threads
+  volatile bool stopped;
   int stop_time;
   uint64_t nodes_searched;
-  move_t killer_moves[MAX_SEARCH_DEPTH + 1][2];
+  search_stack_t stack[MAX_PLY];
+
+  // null moves are off below this ply while a null move cutoff is verified
+  int null_move_min_ply;
+
+  // how well moves are ordered: the share of beta cutoffs that came from the
+  // first move searched
+  uint64_t beta_cutoffs;
+  uint64_t first_move_cutoffs;
+
+  // quiet move ordering learned from beta cutoffs. history is indexed by
+  // [side][from][to], countermoves by the piece and square of the move being
+  // answered
+  int history[2][64][64];
+  move_t countermoves[12][64];
+
+  // set for searches that aren't driven by a GUI, e.g. benchmarks
+  bool silent;
 } search_info_t;
 
+#define MAX_SEARCH_THREADS 256
+
 const wchar_t PIECE_UNICODE[12] = {0x2659, 0x2658, 0x2657, 0x2656,
                                    0x2655, 0x2654, 0x265F, 0x265E,
                                    0x265D, 0x265C, 0x265B, 0x265A};
 
+const uint64_t RANK_1_MASK = 255ULL;
 const uint64_t RANK_4_MASK = 4278190080ULL;
 const uint64_t RANK_5_MASK = 1095216660480ULL;
+const uint64_t RANK_8_MASK = 18374686479671623680ULL;
 
 const uint64_t NOT_A_FILE = 18374403900871474942ULL;
 const uint64_t NOT_H_FILE = 9187201950435737471ULL;
-const uint64_t NOT_AB_FILE = 18229723555195321596ULL;
-const uint64_t NOT_GH_FILE = 4557430888798830399ULL;
-
-uint64_t PAWN_ATTACKS[2][64];
-uint64_t KNIGHT_ATTACKS[64];
-uint64_t KING_ATTACKS[64];
 
 #define IS_RANK_1(sq) (sq >= 0 && sq <= 7)
 #define IS_RANK_8(sq) (sq >= 56 && sq <= 63)
 
-const uint64_t ROOK_MAGICS[64] = {
-    0xa8002c000108020ULL,  0x4440200140003000ULL, 0x8080200010011880ULL,
-    0x380180080141000ULL,  0x1a00060008211044ULL, 0x410001000a0c0008ULL,
-    0x9500060004008100ULL, 0x100024284a20700ULL,  0x802140008000ULL,
-    0x80c01002a00840ULL,   0x402004282011020ULL,  0x9862000820420050ULL,
-    0x1001448011100ULL,    0x6432800200800400ULL, 0x40100010002000cULL,
-    0x2800d0010c080ULL,    0x90c0008000803042ULL, 0x4010004000200041ULL,
-    0x3010010200040ULL,    0xa40828028001000ULL,  0x123010008000430ULL,
-    0x24008004020080ULL,   0x60040001104802ULL,   0x582200028400d1ULL,
-    0x4000802080044000ULL, 0x408208200420308ULL,  0x610038080102000ULL,
-    0x3601000900100020ULL, 0x80080040180ULL,      0xc2020080040080ULL,
-    0x80084400100102ULL,   0x4022408200014401ULL, 0x40052040800082ULL,
-    0xb08200280804000ULL,  0x8a80a008801000ULL,   0x4000480080801000ULL,
-    0x911808800801401ULL,  0x822a003002001894ULL, 0x401068091400108aULL,
-    0x4a10a00004cULL,      0x2000800640008024ULL, 0x1486408102020020ULL,
-    0x100a000d50041ULL,    0x810050020b0020ULL,   0x204000800808004ULL,
-    0x20048100a000cULL,    0x112000831020004ULL,  0x9000040810002ULL,
-    0x440490200208200ULL,  0x8910401000200040ULL, 0x6404200050008480ULL,
-    0x4b824a2010010100ULL, 0x4080801810c0080ULL,  0x400802a0080ULL,
-    0x8224080110026400ULL, 0x40002c4104088200ULL, 0x1002100104a0282ULL,
-    0x1208400811048021ULL, 0x3201014a40d02001ULL, 0x5100019200501ULL,
-    0x101000208001005ULL,  0x2008450080702ULL,    0x1002080301d00cULL,
-    0x410201ce5c030092ULL,
-};
-
-const uint64_t BISHOP_MAGICS[64] = {
-    0x40210414004040ULL,   0x2290100115012200ULL, 0xa240400a6004201ULL,
-    0x80a0420800480ULL,    0x4022021000000061ULL, 0x31012010200000ULL,
-    0x4404421051080068ULL, 0x1040882015000ULL,    0x8048c01206021210ULL,
-    0x222091024088820ULL,  0x4328110102020200ULL, 0x901cc41052000d0ULL,
-    0xa828c20210000200ULL, 0x308419004a004e0ULL,  0x4000840404860881ULL,
-    0x800008424020680ULL,  0x28100040100204a1ULL, 0x82001002080510ULL,
-    0x9008103000204010ULL, 0x141820040c00b000ULL, 0x81010090402022ULL,
-    0x14400480602000ULL,   0x8a008048443c00ULL,   0x280202060220ULL,
-    0x3520100860841100ULL, 0x9810083c02080100ULL, 0x41003000620c0140ULL,
-    0x6100400104010a0ULL,  0x20840000802008ULL,   0x40050a010900a080ULL,
-    0x818404001041602ULL,  0x8040604006010400ULL, 0x1028044001041800ULL,
-    0x80b00828108200ULL,   0xc000280c04080220ULL, 0x3010020080880081ULL,
-    0x10004c0400004100ULL, 0x3010020200002080ULL, 0x202304019004020aULL,
-    0x4208a0000e110ULL,    0x108018410006000ULL,  0x202210120440800ULL,
-    0x100850c828001000ULL, 0x1401024204800800ULL, 0x41028800402ULL,
-    0x20642300480600ULL,   0x20410200800202ULL,   0xca02480845000080ULL,
-    0x140c404a0080410ULL,  0x2180a40108884441ULL, 0x4410420104980302ULL,
-    0x1108040046080000ULL, 0x8141029012020008ULL, 0x894081818082800ULL,
-    0x40020404628000ULL,   0x804100c010c2122ULL,  0x8168210510101200ULL,
-    0x1088148121080ULL,    0x204010100c11010ULL,  0x1814102013841400ULL,
-    0xc00010020602ULL,     0x1045220c040820ULL,   0x12400808070840ULL,
-    0x2004012a040132ULL,
-};
-
-const size_t ROOK_OFFSETS[64] = {
-    0,     4096,  6144,  8192,  10240, 12288, 14336, 16384, 20480, 22528, 23552,
-    24576, 25600, 26624, 27648, 28672, 30720, 32768, 33792, 34816, 35840, 36864,
-    37888, 38912, 40960, 43008, 44032, 45056, 46080, 47104, 48128, 49152, 51200,
-    53248, 54272, 55296, 56320, 57344, 58368, 59392, 61440, 63488, 64512, 65536,
-    66560, 67584, 68608, 69632, 71680, 73728, 74752, 75776, 76800, 77824, 78848,
-    79872, 81920, 86016, 88064, 90112, 92160, 94208, 96256, 98304,
-};
-
-const size_t BISHOP_OFFSETS[64] = {
-    0,    64,   96,   128,  160,  192,  224,  256,  320,  352,  384,
-    416,  448,  480,  512,  544,  576,  608,  640,  768,  896,  1024,
-    1152, 1184, 1216, 1248, 1280, 1408, 1920, 2432, 2560, 2592, 2624,
-    2656, 2688, 2816, 3328, 3840, 3968, 4000, 4032, 4064, 4096, 4224,
-    4352, 4480, 4608, 4640, 4672, 4704, 4736, 4768, 4800, 4832, 4864,
-    4896, 4928, 4992, 5024, 5056, 5088, 5120, 5152, 5184,
-};
-
-const uint8_t ROOK_RELEVANT_BITS[64] = {
-    12, 11, 11, 11, 11, 11, 11, 12, 11, 10, 10, 10, 10, 10, 10, 11,
-    11, 10, 10, 10, 10, 10, 10, 11, 11, 10, 10, 10, 10, 10, 10, 11,
-    11, 10, 10, 10, 10, 10, 10, 11, 11, 10, 10, 10, 10, 10, 10, 11,
-    11, 10, 10, 10, 10, 10, 10, 11, 12, 11, 11, 11, 11, 11, 11, 12,
-};
+// for functions written against a `side` argument. they're always inlined into
+// a caller that passes a constant, so every `side == WHITE` folds away and
+// each side gets its own copy without the branches
+#define SIDE_SPECIALIZED static inline __attribute__((always_inline))
 
-const uint8_t BISHOP_RELEVANT_BITS[64] = {
-    6, 5, 5, 5, 5, 5, 5, 6, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 7, 7, 7, 7,
-    5, 5, 5, 5, 7, 9, 9, 7, 5, 5, 5, 5, 7, 9, 9, 7, 5, 5, 5, 5, 7, 7,
-    7, 7, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 5, 5, 5, 5, 5, 5, 6,
-};
+// everything needed to look up a slider's attacks from one square, so a lookup
+// touches a single struct instead of rebuilding the blocker mask
+typedef struct {
+  uint64_t mask;
+  uint64_t magic;
+  const uint64_t *attacks;
+  uint8_t shift;
+} magic_entry_t;
 
-uint64_t ROOK_ATTACK_TABLE[102400];
-uint64_t BISHOP_ATTACK_TABLE[5248];
+// PAWN_ATTACKS, KNIGHT_ATTACKS, KING_ATTACKS and the slider tables with their
+// magic entries, generated by `magics.out tables` so they're read-only data
+// instead of being filled in at startup
+#include "attack_tables.h"
 
 // clang-format off
 const int CASTLE_PERMISSIONS[64] = {
@@ -335,6 +389,26 @@ const int KING_PST[64] = {
 };
 // clang-format on
 
+// PSTs above merged into one table per piece, already flipped for white, so
+// the incremental update is a single lookup. filled by `init_piece_square`
+int PIECE_SQUARE_VALUES[12][64];
+
+void init_piece_square() {
+  // queens have no PST
+  const int *tables[6] = {PAWN_PST, KNIGHT_PST, BISHOP_PST,
+                          ROOK_PST, NULL,       KING_PST};
+
+  for (int piece = 0; piece < 6; piece++) {
+    for (int square = 0; square < 64; square++) {
+      const int *table = tables[piece];
+
+      PIECE_SQUARE_VALUES[piece][square] =
+          table ? table[SQUARE_MIRROR[square]] : 0;
+      PIECE_SQUARE_VALUES[piece + 6][square] = table ? table[square] : 0;
+    }
+  }
+}
+
 typedef struct {
   uint64_t state;
 } prng_t;
@@ -406,7 +480,7 @@ void board_print(const board_t *board) {
              ? "-"
              : SQUARE_TO_READABLE[board->en_passant_square]);
   printf("Hash: 0x%luULL\n", board->hash);
-  printf("History length: %d\n", board->history_length);
+  printf("History length: %d\n", board->history->length);
 }
 
 // random numbers to be used for zobrist hashing
@@ -455,65 +529,28 @@ uint64_t zobrist_en_passant_file(int en_passant_square) {
   return ZOBRIST_HASH_NUMBERS[769 + 16 + ZOBRIST_EP_FILES[en_passant_square]];
 }
 
+void board_add_piece_score(board_t *board, int square, piece_t piece) {
+  side_t side = piece_side(piece);
+  board->material[side] += PIECE_VALUES[piece];
+  board->piece_square_score[side] += PIECE_SQUARE_VALUES[piece][square];
+}
+
+void board_remove_piece_score(board_t *board, int square, piece_t piece) {
+  side_t side = piece_side(piece);
+  board->material[side] -= PIECE_VALUES[piece];
+  board->piece_square_score[side] -= PIECE_SQUARE_VALUES[piece][square];
+}
+
 uint64_t zobrist_remove_piece(board_t *board, int square) {
   piece_t piece = board->pieces[square];
 
   uint64_t hash = zobrist_piece(square, piece);
+  board_remove_piece_score(board, square, piece);
 
-  uint64_t clear_bitmask = ~(1ULL << square);
-
-  switch (piece) {
-  case WHITE_PAWN:
-    board->white_pawns &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case WHITE_KNIGHT:
-    board->white_knights &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case WHITE_BISHOP:
-    board->white_bishops &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case WHITE_ROOK:
-    board->white_rooks &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case WHITE_QUEEN:
-    board->white_queens &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case WHITE_KING:
-    board->white_king &= clear_bitmask;
-    board->occupancies[WHITE] &= clear_bitmask;
-    break;
-  case BLACK_PAWN:
-    board->black_pawns &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  case BLACK_KNIGHT:
-    board->black_knights &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  case BLACK_BISHOP:
-    board->black_bishops &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  case BLACK_ROOK:
-    board->black_rooks &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  case BLACK_QUEEN:
-    board->black_queens &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  case BLACK_KING:
-    board->black_king &= clear_bitmask;
-    board->occupancies[BLACK] &= clear_bitmask;
-    break;
-  default:
-    break;
-  }
+  // xor is enough, callers only ever remove from an occupied square
+  uint64_t bitboard = 1ULL << square;
+  board->bitboards[piece] ^= bitboard;
+  board->occupancies[piece_side(piece)] ^= bitboard;
 
   board->pieces[square] = EMPTY;
 
@@ -523,68 +560,44 @@ uint64_t zobrist_remove_piece(board_t *board, int square) {
 uint64_t zobrist_add_piece(board_t *board, int square, piece_t piece) {
   board->pieces[square] = piece;
 
-  uint64_t set_bitmask = 1ULL << square;
-
-  switch (piece) {
-  case WHITE_PAWN:
-    board->white_pawns |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case WHITE_KNIGHT:
-    board->white_knights |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case WHITE_BISHOP:
-    board->white_bishops |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case WHITE_ROOK:
-    board->white_rooks |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case WHITE_QUEEN:
-    board->white_queens |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case WHITE_KING:
-    board->white_king |= set_bitmask;
-    board->occupancies[WHITE] |= set_bitmask;
-    break;
-  case BLACK_PAWN:
-    board->black_pawns |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  case BLACK_KNIGHT:
-    board->black_knights |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  case BLACK_BISHOP:
-    board->black_bishops |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  case BLACK_ROOK:
-    board->black_rooks |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  case BLACK_QUEEN:
-    board->black_queens |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  case BLACK_KING:
-    board->black_king |= set_bitmask;
-    board->occupancies[BLACK] |= set_bitmask;
-    break;
-  default:
+#ifdef DEBUG
+  if (piece == EMPTY) {
     printf("Tried to move piece from empty square!\n");
     printf("FROM: %s\n", SQUARE_TO_READABLE[square]);
     printf("TO: %s\n", SQUARE_TO_READABLE[square]);
     board_print(board);
     exit(EXIT_FAILURE);
   }
+#endif
+
+  uint64_t bitboard = 1ULL << square;
+  board->bitboards[piece] |= bitboard;
+  board->occupancies[piece_side(piece)] |= bitboard;
+
+  board_add_piece_score(board, square, piece);
 
   return zobrist_piece(square, piece);
 }
 
+// moves whatever is on `from_square` to an empty `to_square`. one xor per
+// bitboard covers both squares, and material doesn't change
+uint64_t zobrist_move_piece(board_t *board, int from_square, int to_square) {
+  piece_t piece = board->pieces[from_square];
+  side_t side = piece_side(piece);
+  uint64_t bitboard = (1ULL << from_square) | (1ULL << to_square);
+
+  board->bitboards[piece] ^= bitboard;
+  board->occupancies[side] ^= bitboard;
+
+  board->pieces[from_square] = EMPTY;
+  board->pieces[to_square] = piece;
+
+  board->piece_square_score[side] += PIECE_SQUARE_VALUES[piece][to_square] -
+                                     PIECE_SQUARE_VALUES[piece][from_square];
+
+  return zobrist_piece(from_square, piece) ^ zobrist_piece(to_square, piece);
+}
+
 uint64_t generate_hash(const board_t *board) {
   uint64_t hash = 0ULL;
 
@@ -639,21 +652,12 @@ void bitboard_print(uint64_t bitboard, piece_t piece) {
 };
 
 void board_reset(board_t *board) {
-  board->white_pawns = 0ULL;
-  board->white_knights = 0ULL;
-  board->white_bishops = 0ULL;
-  board->white_rooks = 0ULL;
-  board->white_queens = 0ULL;
-  board->white_king = 0ULL;
-
-  board->black_pawns = 0ULL;
-  board->black_knights = 0ULL;
-  board->black_bishops = 0ULL;
-  board->black_rooks = 0ULL;
-  board->black_queens = 0ULL;
-  board->black_king = 0ULL;
+  for (int i = 0; i < 12; i++) {
+    board->bitboards[i] = 0ULL;
+  }
 
   board->halfmove_clock = 0;
+  board->repetition_clock = 0;
   board->side = WHITE;
   board->castle_rights = 0;
   board->en_passant_square = NO_SQUARE;
@@ -666,16 +670,27 @@ void board_reset(board_t *board) {
   board->occupancies[WHITE] = 0ULL;
   board->occupancies[BLACK] = 0ULL;
 
-  board->history_length = 0;
+  board->material[WHITE] = 0;
+  board->material[BLACK] = 0;
+  board->piece_square_score[WHITE] = 0;
+  board->piece_square_score[BLACK] = 0;
+
+  board->history->length = 0;
   board->ply = 0;
 }
 
 board_t *board_new() {
   board_t *board = malloc(sizeof(board_t));
+  board->history = history_new();
   board_reset(board);
   return board;
 }
 
+void board_free(board_t *board) {
+  history_free(board->history);
+  free(board);
+}
+
 #define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
 #define START_E4_FEN                                                           \
   "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1"
@@ -695,71 +710,10 @@ board_t *board_new() {
 #define CASTLING_NO_QUEENSIDE_FEN "r3k2r/8/8/5B2/5b2/8/8/R3K2R w KQkq - 0 1"
 
 void board_insert_piece(board_t *board, const piece_t piece, const int square) {
-  switch (piece) {
-  case WHITE_PAWN:
-    board->white_pawns |= 1ULL << square;
-    board->pieces[square] = WHITE_PAWN;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case WHITE_KNIGHT:
-    board->white_knights |= 1ULL << square;
-    board->pieces[square] = WHITE_KNIGHT;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case WHITE_BISHOP:
-    board->white_bishops |= 1ULL << square;
-    board->pieces[square] = WHITE_BISHOP;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case WHITE_ROOK:
-    board->white_rooks |= 1ULL << square;
-    board->pieces[square] = WHITE_ROOK;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case WHITE_QUEEN:
-    board->white_queens |= 1ULL << square;
-    board->pieces[square] = WHITE_QUEEN;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case WHITE_KING:
-    board->white_king |= 1ULL << square;
-    board->pieces[square] = WHITE_KING;
-    board->occupancies[WHITE] |= 1ULL << square;
-    break;
-  case BLACK_PAWN:
-    board->black_pawns |= 1ULL << square;
-    board->pieces[square] = BLACK_PAWN;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case BLACK_KNIGHT:
-    board->black_knights |= 1ULL << square;
-    board->pieces[square] = BLACK_KNIGHT;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case BLACK_BISHOP:
-    board->black_bishops |= 1ULL << square;
-    board->pieces[square] = BLACK_BISHOP;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case BLACK_ROOK:
-    board->black_rooks |= 1ULL << square;
-    board->pieces[square] = BLACK_ROOK;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case BLACK_QUEEN:
-    board->black_queens |= 1ULL << square;
-    board->pieces[square] = BLACK_QUEEN;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case BLACK_KING:
-    board->black_king |= 1ULL << square;
-    board->pieces[square] = BLACK_KING;
-    board->occupancies[BLACK] |= 1ULL << square;
-    break;
-  case EMPTY:
-    board->pieces[square] = EMPTY;
-    break;
-  }
+  board->pieces[square] = piece;
+  board->bitboards[piece] |= 1ULL << square;
+  board->occupancies[piece_side(piece)] |= 1ULL << square;
+  board_add_piece_score(board, square, piece);
 }
 
 bool board_parse_FEN(board_t *board, char *fen) {
@@ -929,6 +883,7 @@ bool board_parse_FEN(board_t *board, char *fen) {
   }
 
   board->halfmove_clock = strtol(halfmoves, NULL, 10);
+  board->repetition_clock = board->halfmove_clock;
 
   board->hash = generate_hash(board);
   return true;
@@ -968,17 +923,23 @@ void move_set_score(move_t *move, uint16_t score) {
   *move |= score << 16;
 }
 
-move_list_t *move_list_new() {
-  move_list_t *move_list = malloc(sizeof(move_list_t));
-  move_list->count = 0;
-  return move_list;
-}
+void move_list_reset(move_list_t *move_list) { move_list->count = 0; }
 
 void move_list_push(move_list_t *move_list, move_t move) {
   move_list->moves[move_list->count] = move;
   move_list->count++;
 }
 
+// long algebraic notation, the way UCI expects moves
+void move_print_uci(move_t move) {
+  printf("%s%s", SQUARE_TO_READABLE[move_from(move)],
+         SQUARE_TO_READABLE[move_to(move)]);
+
+  if (move_move_type(move) == PROMOTION) {
+    printf("%c", FLAG_TO_ALGEBRAIC_NOTATION[move_flag(move)]);
+  }
+}
+
 void move_list_print(move_list_t *move_list) {
   printf("Generated Moves:\n");
   for (size_t i = 0; i < move_list->count; i++) {
@@ -1001,1282 +962,1544 @@ bool is_promotion(square_t destination, side_t side) {
          (side == BLACK && IS_RANK_1(destination));
 }
 
-void generate_pawn_moves(const board_t *board, move_list_t *move_list) {
-  // each occupied square is set to `1`
-  uint64_t empty = ~(board->occupancies[WHITE] | board->occupancies[BLACK]);
+// with USE_PEXT the blocker bits are packed straight into an index using the
+// BMI2 `pext` instruction, otherwise we use the magic multiply and shift. the
+// two put blocker sets in different slots, so magics.c writes tables for each
+size_t get_magic_index(const magic_entry_t *entry, uint64_t blockers) {
+#ifdef USE_PEXT
+  return _pext_u64(blockers, entry->mask);
+#else
+  return ((blockers & entry->mask) * entry->magic) >> entry->shift;
+#endif
+}
 
-  if (board->side == WHITE) {
-    uint64_t pawns = board->white_pawns;
-
-    while (pawns != 0) {
-      int from_square = bitboard_pop_bit(&pawns);
-
-      uint64_t potential_single_push = 1ULL << (from_square + 8);
-
-      if ((potential_single_push & empty) != 0) {
-        if (is_promotion(from_square + 8, WHITE)) {
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             PROMOTION, QUEEN_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             PROMOTION, ROOK_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             PROMOTION, BISHOP_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             PROMOTION, KNIGHT_PROMOTION));
-        } else {
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             QUIET, NO_FLAG));
-        }
+uint64_t get_slider_attacks(const magic_entry_t *entry, uint64_t blockers) {
+  return entry->attacks[get_magic_index(entry, blockers)];
+}
 
-        uint64_t potential_double_push = 1ULL << (from_square + 16);
+uint64_t get_bishop_attacks(int square, uint64_t blockers) {
+  return get_slider_attacks(&BISHOP_MAGIC_ENTRIES[square], blockers);
+}
 
-        if ((potential_double_push & RANK_4_MASK & empty) != 0) {
-          move_list_push(move_list, move_new(from_square, from_square + 16,
-                                             QUIET, NO_FLAG));
-        }
-      }
+uint64_t get_rook_attacks(int square, uint64_t blockers) {
+  return get_slider_attacks(&ROOK_MAGIC_ENTRIES[square], blockers);
+}
 
-      uint64_t en_passant_bitboard = board->en_passant_square != NO_SQUARE
-                                         ? (1ULL << board->en_passant_square)
-                                         : 0ULL;
-
-      uint64_t enemy = board->occupancies[BLACK] | en_passant_bitboard;
-      uint64_t attacks = (PAWN_ATTACKS[WHITE][from_square]) & enemy;
-
-      while (attacks != 0) {
-        int attacked_square = bitboard_pop_bit(&attacks);
-
-        if (is_promotion(attacked_square, WHITE)) {
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, QUEEN_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, ROOK_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, BISHOP_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, KNIGHT_PROMOTION));
-        } else {
-          move_list_push(move_list,
-                         move_new(from_square, attacked_square, CAPTURE,
-                                  attacked_square == board->en_passant_square
-                                      ? EN_PASSANT_FLAG
-                                      : NO_FLAG));
-        }
-      }
-    }
+uint64_t get_queen_attacks(int square, uint64_t blockers) {
+  return get_rook_attacks(square, blockers) |
+         get_bishop_attacks(square, blockers);
+}
 
-  } else {
-    uint64_t pawns = board->black_pawns;
-
-    while (pawns != 0) {
-      int from_square = bitboard_pop_bit(&pawns);
-
-      uint64_t potential_single_push = 1ULL << (from_square - 8);
-
-      if ((potential_single_push & empty) != 0) {
-        if (is_promotion(from_square - 8, BLACK)) {
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             PROMOTION, QUEEN_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             PROMOTION, ROOK_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             PROMOTION, BISHOP_PROMOTION));
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             PROMOTION, KNIGHT_PROMOTION));
-        } else {
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             QUIET, NO_FLAG));
-        }
+// squares strictly between two squares on a shared rank, file or diagonal, and
+// the whole line through them from edge to edge. both are empty for squares
+// that aren't aligned
+uint64_t BETWEEN[64][64];
+uint64_t LINE[64][64];
 
-        uint64_t potential_double_push = 1ULL << (from_square - 16);
+void init_line_masks() {
+  for (int from = 0; from < 64; from++) {
+    for (int to = 0; to < 64; to++) {
+      uint64_t from_bitboard = 1ULL << from;
+      uint64_t to_bitboard = 1ULL << to;
 
-        if ((potential_double_push & RANK_5_MASK & empty) != 0) {
-          move_list_push(move_list, move_new(from_square, from_square - 16,
-                                             QUIET, NO_FLAG));
-        }
+      BETWEEN[from][to] = 0ULL;
+      LINE[from][to] = 0ULL;
+
+      if (from == to) {
+        continue;
       }
 
-      uint64_t en_passant_bitboard = board->en_passant_square != NO_SQUARE
-                                         ? (1ULL << board->en_passant_square)
-                                         : 0ULL;
-
-      uint64_t enemy = board->occupancies[WHITE] | en_passant_bitboard;
-
-      uint64_t attacks = (PAWN_ATTACKS[BLACK][from_square]) & enemy;
-
-      while (attacks != 0) {
-        int attacked_square = bitboard_pop_bit(&attacks);
-
-        if (is_promotion(attacked_square, BLACK)) {
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, QUEEN_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, ROOK_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, BISHOP_PROMOTION));
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, KNIGHT_PROMOTION));
-        } else {
-          move_list_push(move_list,
-                         move_new(from_square, attacked_square, CAPTURE,
-                                  attacked_square == board->en_passant_square
-                                      ? EN_PASSANT_FLAG
-                                      : NO_FLAG));
-        }
+      if (get_rook_attacks(from, 0ULL) & to_bitboard) {
+        BETWEEN[from][to] = get_rook_attacks(from, to_bitboard) &
+                            get_rook_attacks(to, from_bitboard);
+        LINE[from][to] =
+            (get_rook_attacks(from, 0ULL) & get_rook_attacks(to, 0ULL)) |
+            from_bitboard | to_bitboard;
+      } else if (get_bishop_attacks(from, 0ULL) & to_bitboard) {
+        BETWEEN[from][to] = get_bishop_attacks(from, to_bitboard) &
+                            get_bishop_attacks(to, from_bitboard);
+        LINE[from][to] =
+            (get_bishop_attacks(from, 0ULL) & get_bishop_attacks(to, 0ULL)) |
+            from_bitboard | to_bitboard;
       }
     }
   }
 }
 
-void generate_knight_moves(const board_t *board, move_list_t *move_list) {
-  uint64_t knights =
-      board->side == WHITE ? board->white_knights : board->black_knights;
-
-  side_t current_side = board->side;
+// every piece of `attacker_side` attacking `square`, with sliders seeing
+// through the given occupancy rather than the board's
+uint64_t get_attackers(const board_t *board, int square, side_t attacker_side,
+                       uint64_t occupancy) {
+  uint64_t pawns = board->bitboards[side_piece(attacker_side, WHITE_PAWN)];
+  uint64_t knights = board->bitboards[side_piece(attacker_side, WHITE_KNIGHT)];
+  uint64_t bishops = board->bitboards[side_piece(attacker_side, WHITE_BISHOP)];
+  uint64_t rooks = board->bitboards[side_piece(attacker_side, WHITE_ROOK)];
+  uint64_t queens = board->bitboards[side_piece(attacker_side, WHITE_QUEEN)];
+  uint64_t king = board->bitboards[side_piece(attacker_side, WHITE_KING)];
+
+  return (PAWN_ATTACKS[attacker_side ^ 1][square] & pawns) |
+         (KNIGHT_ATTACKS[square] & knights) | (KING_ATTACKS[square] & king) |
+         (get_bishop_attacks(square, occupancy) & (bishops | queens)) |
+         (get_rook_attacks(square, occupancy) & (rooks | queens));
+}
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+// finds the cheapest piece of `side` among `attackers`, returning its square
+// as a bitboard and the piece through `piece`
+uint64_t get_least_valuable_attacker(const board_t *board, uint64_t attackers,
+                                     side_t side, piece_t *piece) {
+  for (piece_t white_piece = WHITE_PAWN; white_piece <= WHITE_KING;
+       white_piece++) {
+    piece_t side_specific = side_piece(side, white_piece);
+    uint64_t subset = attackers & board->bitboards[side_specific];
+
+    if (subset != 0) {
+      *piece = side_specific;
+      return get_lsb(subset);
+    }
+  }
 
-  while (knights != 0) {
-    square_t from_square = bitboard_pop_bit(&knights);
+  return 0ULL;
+}
 
-    uint64_t knight_moves =
-        (KNIGHT_ATTACKS[from_square]) & ~current_side_occupancy;
+// static exchange evaluation: the material the side to move comes out with if
+// both sides keep recapturing on the target square with their cheapest
+// attacker, and either can stop when carrying on would lose more
+int static_exchange_evaluation(const board_t *board, move_t move) {
+  int from_square = move_from(move);
+  int to_square = move_to(move);
 
-    while (knight_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&knight_moves);
+  piece_t attacker = board->pieces[from_square];
+  piece_t target = board->pieces[to_square];
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      } else {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, QUIET, NO_FLAG));
-      }
-    }
+  if (move_move_type(move) == CAPTURE && move_flag(move) == EN_PASSANT_FLAG) {
+    int captured_square = board->side == WHITE ? to_square + 8 : to_square - 8;
+    target = board->pieces[captured_square];
+    occupied ^= 1ULL << captured_square;
   }
-}
 
-uint64_t generate_pawn_attack_mask(square_t square, side_t side) {
-  uint64_t mask = 0ULL;
-  uint64_t bitboard = 1ULL << square;
+  int gain[32];
+  int depth = 0;
 
-  if (side == WHITE) {
-    uint64_t east_attacks = (bitboard << 9) & NOT_A_FILE;
-    uint64_t west_attacks = (bitboard << 7) & NOT_H_FILE;
-    mask |= east_attacks;
-    mask |= west_attacks;
-  } else {
-    uint64_t east_attacks = (bitboard >> 7) & NOT_A_FILE;
-    uint64_t west_attacks = (bitboard >> 9) & NOT_H_FILE;
-    mask |= east_attacks;
-    mask |= west_attacks;
-  }
+  gain[0] = PIECE_VALUES[target];
 
-  return mask;
-}
+  // a promoting pawn stands on the square as the new piece
+  if (move_move_type(move) == PROMOTION) {
+    piece_t promoted = (piece_t)(attacker + move_flag(move) + 1);
+    gain[0] += PIECE_VALUES[promoted] - PIECE_VALUES[attacker];
+    attacker = promoted;
+  }
 
-uint64_t generate_knight_attack_mask(square_t square) {
-  uint64_t mask = 0ULL;
-  uint64_t bitboard = 1ULL << square;
+  uint64_t queens =
+      board->bitboards[WHITE_QUEEN] | board->bitboards[BLACK_QUEEN];
+  uint64_t bishops =
+      board->bitboards[WHITE_BISHOP] | board->bitboards[BLACK_BISHOP] | queens;
+  uint64_t rooks =
+      board->bitboards[WHITE_ROOK] | board->bitboards[BLACK_ROOK] | queens;
 
-  uint64_t north_north_east = (bitboard << 17) & NOT_A_FILE;
-  mask |= north_north_east;
+  uint64_t from_bitboard = 1ULL << from_square;
+  uint64_t attackers = get_attackers(board, to_square, WHITE, occupied) |
+                       get_attackers(board, to_square, BLACK, occupied);
+  side_t side = board->side;
 
-  uint64_t north_east_east = (bitboard << 10) & NOT_AB_FILE;
-  mask |= north_east_east;
+  while (1) {
+    depth++;
 
-  uint64_t south_east_east = (bitboard >> 6) & NOT_AB_FILE;
-  mask |= south_east_east;
+    // what the side to move would be up if the piece it just captured with
+    // gets taken in turn
+    gain[depth] = PIECE_VALUES[attacker] - gain[depth - 1];
 
-  uint64_t south_south_east = (bitboard >> 15) & NOT_A_FILE;
-  mask |= south_south_east;
+    // neither side can come out ahead by continuing from here
+    if ((-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]) <
+        0) {
+      break;
+    }
 
-  uint64_t north_north_west = (bitboard << 15) & NOT_H_FILE;
-  mask |= north_north_west;
+    // lifting the attacker can uncover a slider behind it
+    occupied ^= from_bitboard;
+    attackers |= (get_bishop_attacks(to_square, occupied) & bishops) |
+                 (get_rook_attacks(to_square, occupied) & rooks);
+    attackers &= occupied;
 
-  uint64_t north_west_west = (bitboard << 6) & NOT_GH_FILE;
-  mask |= north_west_west;
+    side ^= 1;
+    from_bitboard =
+        get_least_valuable_attacker(board, attackers, side, &attacker);
 
-  uint64_t south_west_west = (bitboard >> 10) & NOT_GH_FILE;
-  mask |= south_west_west;
+    if (from_bitboard == 0 || depth == 31) {
+      break;
+    }
+  }
 
-  uint64_t south_south_west = (bitboard >> 17) & NOT_H_FILE;
-  mask |= south_south_west;
+  while (--depth > 0) {
+    gain[depth - 1] =
+        -(-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]);
+  }
 
-  return mask;
+  return gain[0];
 }
 
-uint64_t east_one(uint64_t bits) { return (bits << 1) & NOT_A_FILE; }
-uint64_t west_one(uint64_t bits) { return (bits >> 1) & NOT_H_FILE; }
-uint64_t north_one(uint64_t bits) { return bits << 8; }
-uint64_t south_one(uint64_t bits) { return bits >> 8; }
+// capturing something worth at least as much as the capturing piece can't
+// lose material, so the full exchange only needs working out otherwise
+bool is_losing_capture(const board_t *board, move_t move) {
+  piece_t attacker = board->pieces[move_from(move)];
+  piece_t target = board->pieces[move_to(move)];
 
-uint64_t generate_king_attack_mask(int square) {
-  uint64_t king_bitboard = 1ULL << square;
-  uint64_t attacks = east_one(king_bitboard) | west_one(king_bitboard);
-  king_bitboard |= attacks;
-  attacks |= north_one(king_bitboard) | south_one(king_bitboard);
-  return attacks;
+  if (target == EMPTY || PIECE_VALUES[target] >= PIECE_VALUES[attacker]) {
+    return false;
+  }
+
+  return static_exchange_evaluation(board, move) < 0;
 }
 
-uint64_t generate_rook_blocker_mask(square_t square) {
-  uint64_t mask = 0ULL;
+// fills in everything except the pins, which is all the search needs to know
+// whether a node is in check
+void legality_find_checks(legality_t *legality, const board_t *board) {
+  side_t side = board->side;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
+  uint64_t king = board->bitboards[side_piece(side, WHITE_KING)];
+
+  legality->king_square = __builtin_ctzll(king);
+  legality->checkers =
+      get_attackers(board, legality->king_square, side ^ 1, occupied);
+  legality->pinned = 0ULL;
+  legality->has_enemy_attacks = false;
+
+  if (legality->checkers == 0) {
+    legality->check_mask = ~0ULL;
+  } else if ((legality->checkers & (legality->checkers - 1)) == 0) {
+    int checker_square = __builtin_ctzll(legality->checkers);
+    legality->check_mask =
+        legality->checkers | BETWEEN[legality->king_square][checker_square];
+  } else {
+    legality->check_mask = 0ULL;
+  }
+}
 
-  int start_rank = square / 8;
-  int start_file = square % 8;
+void legality_find_pins(legality_t *legality, const board_t *board) {
+  side_t side = board->side;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-  for (int rank = start_rank + 1; rank < 7; rank++) {
-    mask |= 1ULL << ((rank * 8) + start_file);
+  legality->pinned = 0ULL;
+
+  uint64_t enemy_queens = board->bitboards[side_piece(side ^ 1, WHITE_QUEEN)];
+  uint64_t enemy_diagonal =
+      board->bitboards[side_piece(side ^ 1, WHITE_BISHOP)] | enemy_queens;
+  uint64_t enemy_orthogonal =
+      board->bitboards[side_piece(side ^ 1, WHITE_ROOK)] | enemy_queens;
+
+  // enemy sliders that would hit the king if none of our pieces were in the
+  // way. any of them with exactly one of our pieces in between pins it
+  uint64_t enemy_occupancy = board->occupancies[side ^ 1];
+  uint64_t snipers =
+      (get_bishop_attacks(legality->king_square, enemy_occupancy) &
+       enemy_diagonal) |
+      (get_rook_attacks(legality->king_square, enemy_occupancy) &
+       enemy_orthogonal);
+
+  while (snipers != 0) {
+    int sniper_square = bitboard_pop_bit(&snipers);
+    uint64_t blockers =
+        BETWEEN[legality->king_square][sniper_square] & occupied;
+
+    if (blockers != 0 && (blockers & (blockers - 1)) == 0 &&
+        (blockers & board->occupancies[side])) {
+      legality->pinned |= blockers;
+    }
   }
+}
 
-  for (int rank = start_rank - 1; rank > 0; rank--) {
-    mask |= 1ULL << ((rank * 8) + start_file);
-  }
+legality_t legality_new(const board_t *board) {
+  legality_t legality;
+  legality_find_checks(&legality, board);
+  legality_find_pins(&legality, board);
+  return legality;
+}
 
-  for (int file = start_file + 1; file < 7; file++) {
-    mask |= 1ULL << ((start_rank * 8) + file);
-  }
+bool is_double_check(const legality_t *legality) {
+  return (legality->checkers & (legality->checkers - 1)) != 0;
+}
+
+// squares the piece on `from_square` may move to without exposing the king
+uint64_t legal_destinations(const legality_t *legality, int from_square) {
+  uint64_t destinations = legality->check_mask;
 
-  for (int file = start_file - 1; file > 0; file--) {
-    mask |= 1ULL << ((start_rank * 8) + file);
+  if (legality->pinned & (1ULL << from_square)) {
+    destinations &= LINE[legality->king_square][from_square];
   }
 
-  return mask;
+  return destinations;
 }
 
-uint64_t generate_bishop_blocker_mask(square_t square) {
-  uint64_t mask = 0ULL;
+// en passant removes two pieces from the same rank at once, so it can uncover
+// a check that the pin mask doesn't see. simplest to just try it
+SIDE_SPECIALIZED bool is_en_passant_legal(const board_t *board,
+                                          const legality_t *legality,
+                                          int from_square, int to_square,
+                                          side_t side) {
+  int captured_square = side == WHITE ? to_square - 8 : to_square + 8;
 
-  int start_rank = square / 8;
-  int start_file = square % 8;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
+  occupied ^= (1ULL << from_square) | (1ULL << captured_square) |
+              (1ULL << to_square);
 
-  int rank;
-  int file;
+  uint64_t attackers =
+      get_attackers(board, legality->king_square, side ^ 1, occupied) &
+      ~(1ULL << captured_square);
 
-  for (rank = start_rank + 1, file = start_file + 1; rank < 7 && file < 7;
-       rank++, file++) {
-    mask |= 1ULL << ((rank * 8) + file);
-  }
+  return attackers == 0;
+}
 
-  for (rank = start_rank + 1, file = start_file - 1; rank < 7 && file > 0;
-       rank++, file--) {
-    mask |= 1ULL << ((rank * 8) + file);
-  }
+// captures are every capture plus queen promotions, the moves quiescence search
+// looks at. quiets are everything else, including under-promotions
+typedef enum { ALL_MOVES, CAPTURE_MOVES, QUIET_MOVES } move_gen_type_t;
 
-  for (rank = start_rank - 1, file = start_file + 1; rank > 0 && file < 7;
-       rank--, file++) {
-    mask |= 1ULL << ((rank * 8) + file);
+void push_promotions(move_list_t *move_list, int from_square, int to_square,
+                     move_gen_type_t type) {
+  if (type != QUIET_MOVES) {
+    move_list_push(move_list, move_new(from_square, to_square, PROMOTION,
+                                       QUEEN_PROMOTION));
   }
 
-  for (rank = start_rank - 1, file = start_file - 1; rank > 0 && file > 0;
-       rank--, file--) {
-    mask |= 1ULL << ((rank * 8) + file);
+  if (type != CAPTURE_MOVES) {
+    move_list_push(move_list,
+                   move_new(from_square, to_square, PROMOTION, ROOK_PROMOTION));
+    move_list_push(move_list, move_new(from_square, to_square, PROMOTION,
+                                       BISHOP_PROMOTION));
+    move_list_push(move_list, move_new(from_square, to_square, PROMOTION,
+                                       KNIGHT_PROMOTION));
   }
+}
 
-  return mask;
+// shifts every pawn one step towards the enemy side. `west` and `east` are the
+// capture directions, towards the a and h files
+SIDE_SPECIALIZED uint64_t pawn_push(uint64_t pawns, side_t side) {
+  return side == WHITE ? pawns << 8 : pawns >> 8;
 }
 
-uint64_t generate_rook_attack_mask(int square, uint64_t blockers) {
-  uint64_t mask = 0ULL;
+SIDE_SPECIALIZED uint64_t pawn_west_attacks(uint64_t pawns, side_t side) {
+  return (side == WHITE ? pawns << 7 : pawns >> 9) & NOT_H_FILE;
+}
 
-  int start_rank = square / 8;
-  int start_file = square % 8;
+SIDE_SPECIALIZED uint64_t pawn_east_attacks(uint64_t pawns, side_t side) {
+  return (side == WHITE ? pawns << 9 : pawns >> 7) & NOT_A_FILE;
+}
 
-  for (int rank = start_rank + 1; rank < 8; rank++) {
-    mask |= 1ULL << ((rank * 8) + start_file);
-    if (blockers & (1ULL << ((rank * 8) + start_file))) {
-      break;
-    }
+// the squares the enemy attacks, worked out on first use and kept for the
+// rest of the node. our king is left out of the occupancy so it can't step
+// back along the line of a slider checking it
+SIDE_SPECIALIZED uint64_t get_enemy_attacks(const board_t *board,
+                                            legality_t *legality,
+                                            side_t side) {
+  if (legality->has_enemy_attacks) {
+    return legality->enemy_attacks;
   }
 
-  for (int rank = start_rank - 1; rank >= 0; rank--) {
-    mask |= 1ULL << ((rank * 8) + start_file);
-    if (blockers & (1ULL << ((rank * 8) + start_file))) {
-      break;
-    }
+  side_t enemy = side ^ 1;
+  uint64_t occupied = (board->occupancies[WHITE] | board->occupancies[BLACK]) ^
+                      (1ULL << legality->king_square);
+
+  uint64_t pawns = board->bitboards[side_piece(enemy, WHITE_PAWN)];
+  uint64_t knights = board->bitboards[side_piece(enemy, WHITE_KNIGHT)];
+  uint64_t queens = board->bitboards[side_piece(enemy, WHITE_QUEEN)];
+  uint64_t diagonal = board->bitboards[side_piece(enemy, WHITE_BISHOP)] | queens;
+  uint64_t orthogonal = board->bitboards[side_piece(enemy, WHITE_ROOK)] | queens;
+  uint64_t king = board->bitboards[side_piece(enemy, WHITE_KING)];
+
+  uint64_t attacks = pawn_west_attacks(pawns, enemy) |
+                     pawn_east_attacks(pawns, enemy) |
+                     KING_ATTACKS[__builtin_ctzll(king)];
+
+  while (knights != 0) {
+    attacks |= KNIGHT_ATTACKS[bitboard_pop_bit(&knights)];
   }
 
-  for (int file = start_file + 1; file < 8; file++) {
-    mask |= 1ULL << ((start_rank * 8) + file);
-    if (blockers & (1ULL << ((start_rank * 8) + file))) {
-      break;
-    }
+  while (diagonal != 0) {
+    attacks |= get_bishop_attacks(bitboard_pop_bit(&diagonal), occupied);
   }
 
-  for (int file = start_file - 1; file >= 0; file--) {
-    mask |= 1ULL << ((start_rank * 8) + file);
-    if (blockers & (1ULL << ((start_rank * 8) + file))) {
-      break;
-    }
+  while (orthogonal != 0) {
+    attacks |= get_rook_attacks(bitboard_pop_bit(&orthogonal), occupied);
   }
 
-  return mask;
-}
+  legality->enemy_attacks = attacks;
+  legality->has_enemy_attacks = true;
 
-uint64_t generate_bishop_attack_mask(int square, uint64_t blockers) {
-  uint64_t mask = 0ULL;
+  return attacks;
+}
 
-  int start_rank = square / 8;
-  int start_file = square % 8;
+// each square in `targets` was reached from the square `offset` behind it
+void push_pawn_targets(move_list_t *move_list, uint64_t targets, int offset,
+                       int move_type) {
+  while (targets != 0) {
+    int to_square = bitboard_pop_bit(&targets);
+    move_list_push(move_list,
+                   move_new(to_square - offset, to_square, move_type, NO_FLAG));
+  }
+}
 
-  int rank;
-  int file;
+void push_pawn_promotions(move_list_t *move_list, uint64_t targets, int offset,
+                          move_gen_type_t type) {
+  while (targets != 0) {
+    int to_square = bitboard_pop_bit(&targets);
+    push_promotions(move_list, to_square - offset, to_square, type);
+  }
+}
 
-  for (rank = start_rank + 1, file = start_file + 1; rank < 8 && file < 8;
-       rank++, file++) {
-    mask |= 1ULL << ((rank * 8) + file);
-    if (blockers & (1ULL << ((rank * 8) + file))) {
-      break;
+// moves all the pawns at once by shifting the bitboard in each direction, so
+// the work doesn't grow with the number of pawns
+SIDE_SPECIALIZED void generate_pawn_moves(const board_t *board,
+                                          move_list_t *move_list,
+                                          const legality_t *legality,
+                                          move_gen_type_t type, side_t side) {
+  // each occupied square is set to `1`
+  uint64_t empty = ~(board->occupancies[WHITE] | board->occupancies[BLACK]);
+  uint64_t pawns = board->bitboards[side_piece(side, WHITE_PAWN)];
+  uint64_t enemy = board->occupancies[side ^ 1] & legality->check_mask;
+
+  int push_offset = side == WHITE ? 8 : -8;
+  int west_offset = side == WHITE ? 7 : -9;
+  int east_offset = side == WHITE ? 9 : -7;
+  uint64_t double_push_rank = side == WHITE ? RANK_4_MASK : RANK_5_MASK;
+  uint64_t promotion_rank = side == WHITE ? RANK_8_MASK : RANK_1_MASK;
+
+  // a pinned pawn can still move along its pin line, so sort each one into
+  // the directions that keep it there. there are hardly ever any of these
+  uint64_t pinned = pawns & legality->pinned;
+  uint64_t pushers = pawns & ~pinned;
+  uint64_t west_capturers = pushers;
+  uint64_t east_capturers = pushers;
+
+  while (pinned != 0) {
+    int from_square = bitboard_pop_bit(&pinned);
+    uint64_t pawn = 1ULL << from_square;
+    uint64_t pin_line = LINE[legality->king_square][from_square];
+
+    if (pawn_push(pawn, side) & pin_line) {
+      pushers |= pawn;
+    }
+    if (pawn_west_attacks(pawn, side) & pin_line) {
+      west_capturers |= pawn;
+    }
+    if (pawn_east_attacks(pawn, side) & pin_line) {
+      east_capturers |= pawn;
     }
   }
 
-  for (rank = start_rank + 1, file = start_file - 1; rank < 8 && file >= 0;
-       rank++, file--) {
-    mask |= 1ULL << ((rank * 8) + file);
-    if (blockers & (1ULL << ((rank * 8) + file))) {
-      break;
-    }
+  uint64_t single_pushes = pawn_push(pushers, side) & empty;
+  // the square in between only has to be empty, it doesn't have to block a
+  // check
+  uint64_t double_pushes =
+      pawn_push(single_pushes, side) & empty & double_push_rank &
+      legality->check_mask;
+  single_pushes &= legality->check_mask;
+
+  uint64_t west_captures = pawn_west_attacks(west_capturers, side) & enemy;
+  uint64_t east_captures = pawn_east_attacks(east_capturers, side) & enemy;
+
+  push_pawn_promotions(move_list, single_pushes & promotion_rank, push_offset,
+                       type);
+  push_pawn_promotions(move_list, west_captures & promotion_rank, west_offset,
+                       type);
+  push_pawn_promotions(move_list, east_captures & promotion_rank, east_offset,
+                       type);
+
+  if (type != QUIET_MOVES) {
+    push_pawn_targets(move_list, west_captures & ~promotion_rank, west_offset,
+                      CAPTURE);
+    push_pawn_targets(move_list, east_captures & ~promotion_rank, east_offset,
+                      CAPTURE);
   }
 
-  for (rank = start_rank - 1, file = start_file + 1; rank >= 0 && file < 8;
-       rank--, file++) {
-    mask |= 1ULL << ((rank * 8) + file);
-    if (blockers & (1ULL << ((rank * 8) + file))) {
-      break;
-    }
+  if (type != CAPTURE_MOVES) {
+    push_pawn_targets(move_list, single_pushes & ~promotion_rank, push_offset,
+                      QUIET);
+    push_pawn_targets(move_list, double_pushes, 2 * push_offset, QUIET);
   }
 
-  for (rank = start_rank - 1, file = start_file - 1; rank >= 0 && file >= 0;
-       rank--, file--) {
-    mask |= 1ULL << ((rank * 8) + file);
-    if (blockers & (1ULL << ((rank * 8) + file))) {
-      break;
+  if (type != QUIET_MOVES && board->en_passant_square != NO_SQUARE) {
+    // the pawns that could capture en passant are the ones an enemy pawn on
+    // the en passant square would attack
+    uint64_t en_passant_pawns =
+        PAWN_ATTACKS[side ^ 1][board->en_passant_square] & pawns;
+
+    while (en_passant_pawns != 0) {
+      int from_square = bitboard_pop_bit(&en_passant_pawns);
+
+      if (is_en_passant_legal(board, legality, from_square,
+                              board->en_passant_square, side)) {
+        move_list_push(move_list,
+                       move_new(from_square, board->en_passant_square, CAPTURE,
+                                EN_PASSANT_FLAG));
+      }
     }
   }
-
-  return mask;
 }
 
-size_t get_magic_index(uint64_t magic, uint64_t mask, uint64_t current_blockers,
-                       uint8_t shift, size_t offset) {
-  uint64_t blockers = current_blockers & mask;
-  uint64_t hash = magic * blockers;
-  return (hash >> shift) + offset;
-}
+// pushes a move to each square in `destinations`, flagging the ones that land
+// on an enemy piece as captures
+SIDE_SPECIALIZED void push_piece_moves(const board_t *board,
+                                       move_list_t *move_list, int from_square,
+                                       uint64_t destinations, side_t side) {
+  uint64_t enemy_occupancy = board->occupancies[side ^ 1];
 
-void add_rook_attack_table_entries(int square) {
-  uint64_t mask = generate_rook_blocker_mask(square);
-  uint64_t magic = ROOK_MAGICS[square];
-  uint64_t blockers = 0ULL;
+  while (destinations != 0) {
+    square_t to_square = bitboard_pop_bit(&destinations);
 
-  while (true) {
-    uint64_t moves = generate_rook_attack_mask(square, blockers);
-    size_t magic_index =
-        get_magic_index(magic, mask, blockers, 64 - ROOK_RELEVANT_BITS[square],
-                        ROOK_OFFSETS[square]);
-    ROOK_ATTACK_TABLE[magic_index] = moves;
+    bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
 
-    blockers = (blockers - mask) & mask;
-    if (blockers == 0) {
-      break;
+    if (is_capture) {
+      move_list_push(move_list,
+                     move_new(from_square, to_square, CAPTURE, NO_FLAG));
+    } else {
+      move_list_push(move_list,
+                     move_new(from_square, to_square, QUIET, NO_FLAG));
     }
   }
 }
 
-void add_bishop_attack_table_entries(int square) {
-  uint64_t mask = generate_bishop_blocker_mask(square);
-  uint64_t magic = BISHOP_MAGICS[square];
-  uint64_t blockers = 0ULL;
+// `targets` is the set of squares we want moves to (empty and enemy squares
+// for all moves, just enemy squares for captures)
+SIDE_SPECIALIZED void generate_knight_moves(const board_t *board,
+                                            move_list_t *move_list,
+                                            const legality_t *legality,
+                                            uint64_t targets, side_t side) {
+  uint64_t knights = board->bitboards[side_piece(side, WHITE_KNIGHT)];
 
-  while (true) {
-    uint64_t moves = generate_bishop_attack_mask(square, blockers);
-    size_t magic_index = get_magic_index(magic, mask, blockers,
-                                         64 - BISHOP_RELEVANT_BITS[square],
-                                         BISHOP_OFFSETS[square]);
-    BISHOP_ATTACK_TABLE[magic_index] = moves;
+  // a pinned knight can never stay on the pin line
+  knights &= ~legality->pinned;
 
-    blockers = (blockers - mask) & mask;
-    if (blockers == 0) {
-      break;
-    }
-  }
-}
+  while (knights != 0) {
+    square_t from_square = bitboard_pop_bit(&knights);
 
-void init_attack_masks() {
-  for (int square = 0; square < 64; square++) {
-    PAWN_ATTACKS[WHITE][square] = generate_pawn_attack_mask(square, WHITE);
-    PAWN_ATTACKS[BLACK][square] = generate_pawn_attack_mask(square, BLACK);
-    KNIGHT_ATTACKS[square] = generate_knight_attack_mask(square);
-    KING_ATTACKS[square] = generate_king_attack_mask(square);
+    uint64_t knight_moves =
+        KNIGHT_ATTACKS[from_square] & targets & legality->check_mask;
 
-    add_rook_attack_table_entries(square);
-    add_bishop_attack_table_entries(square);
+    push_piece_moves(board, move_list, from_square, knight_moves, side);
   }
 }
 
-uint64_t get_bishop_attacks(int square, uint64_t blockers) {
-  size_t magic_index = get_magic_index(
-      BISHOP_MAGICS[square], generate_bishop_blocker_mask(square), blockers,
-      64 - BISHOP_RELEVANT_BITS[square], BISHOP_OFFSETS[square]);
+SIDE_SPECIALIZED void generate_bishop_moves(const board_t *board,
+                                            move_list_t *move_list,
+                                            const legality_t *legality,
+                                            uint64_t targets, side_t side) {
+  uint64_t bishops = board->bitboards[side_piece(side, WHITE_BISHOP)];
 
-  return BISHOP_ATTACK_TABLE[magic_index];
-}
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-uint64_t get_rook_attacks(int square, uint64_t blockers) {
-  size_t magic_index = get_magic_index(
-      ROOK_MAGICS[square], generate_rook_blocker_mask(square), blockers,
-      64 - ROOK_RELEVANT_BITS[square], ROOK_OFFSETS[square]);
+  while (bishops != 0) {
+    square_t from_square = bitboard_pop_bit(&bishops);
+
+    uint64_t bishop_moves = get_bishop_attacks(from_square, occupied) &
+                            targets &
+                            legal_destinations(legality, from_square);
 
-  return ROOK_ATTACK_TABLE[magic_index];
+    push_piece_moves(board, move_list, from_square, bishop_moves, side);
+  }
 }
 
-uint64_t get_queen_attacks(int square, uint64_t blockers) {
-  size_t rook_magic_index = get_magic_index(
-      ROOK_MAGICS[square], generate_rook_blocker_mask(square), blockers,
-      64 - ROOK_RELEVANT_BITS[square], ROOK_OFFSETS[square]);
+SIDE_SPECIALIZED void generate_rook_moves(const board_t *board,
+                                          move_list_t *move_list,
+                                          const legality_t *legality,
+                                          uint64_t targets, side_t side) {
+  uint64_t rooks = board->bitboards[side_piece(side, WHITE_ROOK)];
 
-  size_t bishop_magic_index = get_magic_index(
-      BISHOP_MAGICS[square], generate_bishop_blocker_mask(square), blockers,
-      64 - BISHOP_RELEVANT_BITS[square], BISHOP_OFFSETS[square]);
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-  return ROOK_ATTACK_TABLE[rook_magic_index] |
-         BISHOP_ATTACK_TABLE[bishop_magic_index];
-}
+  while (rooks != 0) {
+    square_t from_square = bitboard_pop_bit(&rooks);
 
-bool is_square_attacked(int square, const board_t *board,
-                        side_t attacker_side) {
-  uint64_t pawns =
-      attacker_side == WHITE ? board->white_pawns : board->black_pawns;
+    uint64_t rook_moves = get_rook_attacks(from_square, occupied) & targets &
+                          legal_destinations(legality, from_square);
 
-  if (PAWN_ATTACKS[attacker_side ^ 1][square] & pawns) {
-    return true;
+    push_piece_moves(board, move_list, from_square, rook_moves, side);
   }
+}
 
-  uint64_t king =
-      attacker_side == WHITE ? board->white_king : board->black_king;
-
-  if (KING_ATTACKS[square] & king) {
-    return true;
-  }
+SIDE_SPECIALIZED void generate_queen_moves(const board_t *board,
+                                           move_list_t *move_list,
+                                           const legality_t *legality,
+                                           uint64_t targets, side_t side) {
+  uint64_t queens = board->bitboards[side_piece(side, WHITE_QUEEN)];
 
-  uint64_t knights =
-      attacker_side == WHITE ? board->white_knights : board->black_knights;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-  if (KNIGHT_ATTACKS[square] & knights) {
-    return true;
-  }
+  while (queens != 0) {
+    square_t from_square = bitboard_pop_bit(&queens);
 
-  uint64_t bishops =
-      attacker_side == WHITE ? board->white_bishops : board->black_bishops;
+    uint64_t queen_moves = get_queen_attacks(from_square, occupied) & targets &
+                           legal_destinations(legality, from_square);
 
-  if (get_bishop_attacks(square, board->occupancies[WHITE] |
-                                     board->occupancies[BLACK]) &
-      bishops) {
-    return true;
+    push_piece_moves(board, move_list, from_square, queen_moves, side);
   }
+}
 
-  uint64_t rooks =
-      attacker_side == WHITE ? board->white_rooks : board->black_rooks;
+SIDE_SPECIALIZED void generate_king_moves(const board_t *board,
+                                          move_list_t *move_list,
+                                          legality_t *legality,
+                                          uint64_t targets, side_t side) {
+  square_t from_square = legality->king_square;
 
-  if (get_rook_attacks(square,
-                       board->occupancies[WHITE] | board->occupancies[BLACK]) &
-      rooks) {
-    return true;
-  }
-
-  uint64_t queens =
-      attacker_side == WHITE ? board->white_queens : board->black_queens;
+  uint64_t king_moves = KING_ATTACKS[from_square] & targets;
 
-  if (get_queen_attacks(square,
-                        board->occupancies[WHITE] | board->occupancies[BLACK]) &
-      queens) {
-    return true;
+  if (king_moves != 0) {
+    king_moves &= ~get_enemy_attacks(board, legality, side);
   }
 
-  return false;
+  push_piece_moves(board, move_list, from_square, king_moves, side);
 }
 
-void generate_bishop_moves(const board_t *board, move_list_t *move_list) {
-  uint64_t bishops =
-      board->side == WHITE ? board->white_bishops : board->black_bishops;
-
-  side_t current_side = board->side;
-
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
-
-  while (bishops != 0) {
-    square_t from_square = bitboard_pop_bit(&bishops);
+SIDE_SPECIALIZED void generate_castling_moves(const board_t *board,
+                                              move_list_t *move_list,
+                                              legality_t *legality,
+                                              side_t side) {
+  // can't castle out of check
+  if (legality->checkers != 0) {
+    return;
+  }
 
-    uint64_t bishop_moves =
-        (get_bishop_attacks(from_square,
-                            current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+  uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-    while (bishop_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&bishop_moves);
+  // black castles on the same files, seven ranks up
+  int back_rank = side == WHITE ? 0 : A8;
+  uint8_t king_castle = side == WHITE ? WHITE_KING_CASTLE : BLACK_KING_CASTLE;
+  uint8_t queen_castle =
+      side == WHITE ? WHITE_QUEEN_CASTLE : BLACK_QUEEN_CASTLE;
+
+  // the king crosses the first two squares of each path, so they mustn't be
+  // attacked. we're not in check, so the king isn't hiding any slider there
+  if (board->castle_rights & king_castle) {
+    uint64_t between = ((1ULL << F1) | (1ULL << G1)) << back_rank;
+
+    if ((occupied & between) == 0 &&
+        (get_enemy_attacks(board, legality, side) & between) == 0) {
+      move_list_push(move_list, move_new(E1 + back_rank, G1 + back_rank,
+                                         CASTLE, NO_FLAG));
+    }
+  }
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  if (board->castle_rights & queen_castle) {
+    uint64_t between = ((1ULL << D1) | (1ULL << C1) | (1ULL << B1))
+                       << back_rank;
+    uint64_t king_path = ((1ULL << D1) | (1ULL << C1)) << back_rank;
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      } else {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, QUIET, NO_FLAG));
-      }
+    if ((occupied & between) == 0 &&
+        (get_enemy_attacks(board, legality, side) & king_path) == 0) {
+      move_list_push(move_list, move_new(E1 + back_rank, C1 + back_rank,
+                                         CASTLE, NO_FLAG));
     }
   }
 }
 
-void generate_rook_moves(const board_t *board, move_list_t *move_list) {
-  uint64_t rooks =
-      board->side == WHITE ? board->white_rooks : board->black_rooks;
-
-  side_t current_side = board->side;
-
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
-
-  while (rooks != 0) {
-    square_t from_square = bitboard_pop_bit(&rooks);
+SIDE_SPECIALIZED void generate_side_moves(const board_t *board,
+                                          move_list_t *move_list,
+                                          legality_t *legality,
+                                          move_gen_type_t type, side_t side) {
+  uint64_t targets = type == CAPTURE_MOVES ? board->occupancies[side ^ 1]
+                     : type == QUIET_MOVES
+                         ? ~(board->occupancies[WHITE] |
+                             board->occupancies[BLACK])
+                         : ~board->occupancies[side];
+
+  // in double check only the king can move
+  if (!is_double_check(legality)) {
+    generate_pawn_moves(board, move_list, legality, type, side);
+    generate_knight_moves(board, move_list, legality, targets, side);
+    generate_bishop_moves(board, move_list, legality, targets, side);
+    generate_rook_moves(board, move_list, legality, targets, side);
+    generate_queen_moves(board, move_list, legality, targets, side);
+  }
 
-    uint64_t rook_moves =
-        (get_rook_attacks(from_square,
-                          current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+  generate_king_moves(board, move_list, legality, targets, side);
 
-    while (rook_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&rook_moves);
+  if (type != CAPTURE_MOVES) {
+    generate_castling_moves(board, move_list, legality, side);
+  }
+}
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+// generates only legal moves, so callers never need to make a move just to
+// find out it leaves the king in check
+void generate_moves(const board_t *board, move_list_t *move_list,
+                    legality_t *legality, move_gen_type_t type) {
+  if (board->side == WHITE) {
+    generate_side_moves(board, move_list, legality, type, WHITE);
+  } else {
+    generate_side_moves(board, move_list, legality, type, BLACK);
+  }
+}
 
-      move_t move;
+void generate_all_moves(const board_t *board, move_list_t *move_list) {
+  legality_t legality = legality_new(board);
+  generate_moves(board, move_list, &legality, ALL_MOVES);
+}
 
-      if (is_capture) {
-        move = move_new(from_square, to_square, CAPTURE, NO_FLAG);
-      } else {
-        move = move_new(from_square, to_square, QUIET, NO_FLAG);
-      }
+void generate_all_captures(const board_t *board, move_list_t *move_list) {
+  legality_t legality = legality_new(board);
+  generate_moves(board, move_list, &legality, CAPTURE_MOVES);
+}
 
-      move_list_push(move_list, move);
-    }
+uint64_t get_piece_attacks(piece_t piece, int square, uint64_t occupancy) {
+  switch (piece % 6) {
+  case WHITE_KNIGHT:
+    return KNIGHT_ATTACKS[square];
+  case WHITE_BISHOP:
+    return get_bishop_attacks(square, occupancy);
+  case WHITE_ROOK:
+    return get_rook_attacks(square, occupancy);
+  case WHITE_QUEEN:
+    return get_queen_attacks(square, occupancy);
+  case WHITE_KING:
+    return KING_ATTACKS[square];
+  default:
+    return 0ULL;
   }
 }
 
-void generate_queen_moves(const board_t *board, move_list_t *move_list) {
-  uint64_t queens =
-      board->side == WHITE ? board->white_queens : board->black_queens;
-
-  side_t current_side = board->side;
+// checks a move that didn't come from the generator for this position (a TT
+// move or a killer) is one it would have generated
+bool is_move_legal(const board_t *board, legality_t *legality,
+                   move_t move) {
+  side_t side = board->side;
+  int from_square = move_from(move);
+  int to_square = move_to(move);
+  uint8_t move_type = move_move_type(move);
+  uint8_t flag = move_flag(move);
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+  piece_t piece = board->pieces[from_square];
+  piece_t captured = board->pieces[to_square];
 
-  while (queens != 0) {
-    square_t from_square = bitboard_pop_bit(&queens);
-
-    uint64_t queen_moves =
-        (get_queen_attacks(from_square,
-                           current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+  if (piece == EMPTY || (piece >= BLACK_PAWN) != (side == BLACK)) {
+    return false;
+  }
 
-    while (queen_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&queen_moves);
+  if (captured != EMPTY && (captured >= BLACK_PAWN) == (side == BLACK)) {
+    return false;
+  }
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  if (move_type == CASTLE) {
+    move_list_t castling_moves;
+    move_list_reset(&castling_moves);
+    generate_castling_moves(board, &castling_moves, legality, side);
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      } else {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, QUIET, NO_FLAG));
+    for (size_t i = 0; i < castling_moves.count; i++) {
+      if (are_moves_equal(move, castling_moves.moves[i])) {
+        return true;
       }
     }
-  }
-}
-
-void generate_king_moves(const board_t *board, move_list_t *move_list) {
-  uint64_t king = board->side == WHITE ? board->white_king : board->black_king;
 
-  side_t current_side = board->side;
-
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
-
-  square_t from_square = bitboard_pop_bit(&king);
+    return false;
+  }
 
-  uint64_t king_moves = KING_ATTACKS[from_square] & ~current_side_occupancy;
+  bool is_pawn = piece == WHITE_PAWN || piece == BLACK_PAWN;
+  uint64_t to_bitboard = 1ULL << to_square;
 
-  while (king_moves != 0) {
-    square_t to_square = bitboard_pop_bit(&king_moves);
+  if (move_type == CAPTURE && flag == EN_PASSANT_FLAG) {
+    return is_pawn && to_square == board->en_passant_square &&
+           (PAWN_ATTACKS[side][from_square] & to_bitboard) &&
+           !is_double_check(legality) &&
+           is_en_passant_legal(board, legality, from_square, to_square, side);
+  }
 
-    bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  if ((move_type == QUIET || move_type == CAPTURE) && flag != NO_FLAG) {
+    return false;
+  }
 
-    if (is_capture) {
-      move_list_push(move_list,
-                     move_new(from_square, to_square, CAPTURE, NO_FLAG));
-    } else {
-      move_list_push(move_list,
-                     move_new(from_square, to_square, QUIET, NO_FLAG));
-    }
+  if ((move_type == QUIET && captured != EMPTY) ||
+      (move_type == CAPTURE && captured == EMPTY)) {
+    return false;
   }
-}
 
-void generate_castling_moves(const board_t *board, move_list_t *move_list) {
   uint64_t occupied = board->occupancies[WHITE] | board->occupancies[BLACK];
 
-  if (board->side == WHITE) {
-    if (board->castle_rights & WHITE_KING_CASTLE) {
-      if ((occupied & (1ULL << F1)) == 0 && (occupied & (1ULL << G1)) == 0 &&
-          !is_square_attacked(E1, board, BLACK) &&
-          !is_square_attacked(F1, board, BLACK) &&
-          !is_square_attacked(G1, board, BLACK)) {
-        move_list_push(move_list, move_new(E1, G1, CASTLE, NO_FLAG));
-      }
+  if (is_pawn) {
+    if (is_promotion(to_square, side) != (move_type == PROMOTION)) {
+      return false;
     }
 
-    if (board->castle_rights & WHITE_QUEEN_CASTLE) {
-      if ((occupied & (1ULL << D1)) == 0 && (occupied & (1ULL << C1)) == 0 &&
-          (occupied & (1ULL << B1)) == 0 &&
-          !is_square_attacked(E1, board, BLACK) &&
-          !is_square_attacked(D1, board, BLACK) &&
-          !is_square_attacked(C1, board, BLACK)) {
-        move_list_push(move_list, move_new(E1, C1, CASTLE, NO_FLAG));
+    int push_offset = side == WHITE ? 8 : -8;
+    uint64_t double_push_rank = side == WHITE ? RANK_4_MASK : RANK_5_MASK;
+
+    if (captured != EMPTY) {
+      if ((PAWN_ATTACKS[side][from_square] & to_bitboard) == 0) {
+        return false;
       }
+    } else if (to_square != from_square + push_offset &&
+               !(to_square == from_square + 2 * push_offset &&
+                 (to_bitboard & double_push_rank) &&
+                 board->pieces[from_square + push_offset] == EMPTY)) {
+      return false;
     }
   } else {
-    if (board->castle_rights & BLACK_KING_CASTLE) {
-      if ((occupied & (1ULL << F8)) == 0 && (occupied & (1ULL << G8)) == 0 &&
-          !is_square_attacked(E8, board, WHITE) &&
-          !is_square_attacked(F8, board, WHITE) &&
-          !is_square_attacked(G8, board, WHITE)) {
-        move_list_push(move_list, move_new(E8, G8, CASTLE, NO_FLAG));
-      }
+    if (move_type == PROMOTION ||
+        (get_piece_attacks(piece, from_square, occupied) & to_bitboard) == 0) {
+      return false;
     }
+  }
 
-    if (board->castle_rights & BLACK_QUEEN_CASTLE) {
-      if ((occupied & (1ULL << D8)) == 0 && (occupied & (1ULL << C8)) == 0 &&
-          (occupied & (1ULL << B8)) == 0 &&
-          !is_square_attacked(E8, board, WHITE) &&
-          !is_square_attacked(D8, board, WHITE) &&
-          !is_square_attacked(C8, board, WHITE)) {
-        move_list_push(move_list, move_new(E8, C8, CASTLE, NO_FLAG));
-      }
-    }
+  if (from_square == legality->king_square) {
+    return (get_enemy_attacks(board, legality, side) & to_bitboard) == 0;
   }
-}
 
-void generate_all_moves(const board_t *board, move_list_t *move_list) {
-  generate_pawn_moves(board, move_list);
-  generate_knight_moves(board, move_list);
-  generate_bishop_moves(board, move_list);
-  generate_rook_moves(board, move_list);
-  generate_queen_moves(board, move_list);
-  generate_king_moves(board, move_list);
-  generate_castling_moves(board, move_list);
+  return !is_double_check(legality) &&
+         (legal_destinations(legality, from_square) & to_bitboard) != 0;
 }
 
-void generate_pawn_captures(const board_t *board, move_list_t *move_list) {
-  // each occupied square is set to `1`
-  uint64_t empty = ~(board->occupancies[WHITE] | board->occupancies[BLACK]);
-
-  if (board->side == WHITE) {
-    uint64_t pawns = board->white_pawns;
+SIDE_SPECIALIZED void make_side_move(board_t *board, move_t move,
+                                     side_t side) {
+  history_item_t irreversible_state = {
+      .hash = board->hash,
+      .castle_rights = board->castle_rights,
+      .en_passant_square = board->en_passant_square,
+      .halfmove_clock = board->halfmove_clock,
+      .repetition_clock = board->repetition_clock,
+      .moved_piece = board->pieces[move_from(move)],
+      .captured_piece = board->pieces[move_to(move)]};
 
-    while (pawns != 0) {
-      int from_square = bitboard_pop_bit(&pawns);
+  board->halfmove_clock++;
+  board->repetition_clock++;
 
-      uint64_t potential_single_push = 1ULL << (from_square + 8);
+  // TODO: could this be lower down?
+  // clear en passant
+  if (board->en_passant_square != NO_SQUARE) {
+    board->hash ^= zobrist_en_passant_file(board->en_passant_square);
+  }
+  board->en_passant_square = NO_SQUARE;
 
-      if ((potential_single_push & empty) != 0) {
-        if (is_promotion(from_square + 8, WHITE)) {
-          move_list_push(move_list, move_new(from_square, from_square + 8,
-                                             PROMOTION, QUEEN_PROMOTION));
-        }
-      }
+  switch (move_move_type(move)) {
+  case QUIET:
+    board->hash ^= zobrist_move_piece(board, move_from(move), move_to(move));
+    break;
+  case CAPTURE: {
+    square_t captured_square = move_to(move);
 
-      uint64_t en_passant_bitboard = board->en_passant_square != NO_SQUARE
-                                         ? (1ULL << board->en_passant_square)
-                                         : 0ULL;
-
-      uint64_t enemy = board->occupancies[BLACK] | en_passant_bitboard;
-      uint64_t attacks = (PAWN_ATTACKS[WHITE][from_square]) & enemy;
-
-      while (attacks != 0) {
-        int attacked_square = bitboard_pop_bit(&attacks);
-
-        if (is_promotion(attacked_square, WHITE)) {
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, QUEEN_PROMOTION));
-        } else {
-          move_list_push(move_list,
-                         move_new(from_square, attacked_square, CAPTURE,
-                                  attacked_square == board->en_passant_square
-                                      ? EN_PASSANT_FLAG
-                                      : NO_FLAG));
-        }
-      }
+    if (move_flag(move) == EN_PASSANT_FLAG) {
+      captured_square =
+          side == WHITE ? (move_to(move) - 8) : (move_to(move) + 8);
+      irreversible_state.captured_piece = board->pieces[captured_square];
     }
 
-  } else {
-    uint64_t pawns = board->black_pawns;
-
-    while (pawns != 0) {
-      int from_square = bitboard_pop_bit(&pawns);
+    board->hash ^= zobrist_remove_piece(board, captured_square);
+    board->hash ^= zobrist_move_piece(board, move_from(move), move_to(move));
+    break;
+  }
+  case CASTLE: {
+    // the king lands on the g or c file, the rook jumps over it from the h or
+    // a file
+    bool king_side = (move_to(move) & 7) == (G1 & 7);
+    square_t rook_from_square =
+        king_side ? move_to(move) + 1 : move_to(move) - 2;
+    square_t rook_to_square = king_side ? move_to(move) - 1 : move_to(move) + 1;
+
+    board->hash ^= zobrist_move_piece(board, move_from(move), move_to(move));
+    board->hash ^= zobrist_move_piece(board, rook_from_square, rook_to_square);
+    break;
+  }
+  case PROMOTION: {
+    board->hash ^= zobrist_remove_piece(board, move_from(move));
 
-      uint64_t potential_single_push = 1ULL << (from_square - 8);
+    if (irreversible_state.captured_piece != EMPTY) {
+      board->hash ^= zobrist_remove_piece(board, move_to(move));
+    }
 
-      if ((potential_single_push & empty) != 0) {
-        if (is_promotion(from_square - 8, BLACK)) {
-          move_list_push(move_list, move_new(from_square, from_square - 8,
-                                             PROMOTION, QUEEN_PROMOTION));
-        }
-      }
+    // promotion flags are in the same order as the pieces, from the knight
+    piece_t promotion_piece =
+        side_piece(side, (piece_t)(WHITE_KNIGHT + move_flag(move)));
 
-      uint64_t en_passant_bitboard = board->en_passant_square != NO_SQUARE
-                                         ? (1ULL << board->en_passant_square)
-                                         : 0ULL;
+    board->hash ^= zobrist_add_piece(board, move_to(move), promotion_piece);
+    break;
+  }
+  }
 
-      uint64_t enemy = board->occupancies[WHITE] | en_passant_bitboard;
+  // captures reset the fifty-move rule clock too
+  if (irreversible_state.captured_piece != EMPTY) {
+    board->halfmove_clock = 0;
+    board->repetition_clock = 0;
+  }
 
-      uint64_t attacks = (PAWN_ATTACKS[BLACK][from_square]) & enemy;
+  if (irreversible_state.moved_piece == side_piece(side, WHITE_PAWN)) {
+    // pawn moves reset fifty-move rule clock
+    board->halfmove_clock = 0;
+    board->repetition_clock = 0;
 
-      while (attacks != 0) {
-        int attacked_square = bitboard_pop_bit(&attacks);
+    // double pawn push
+    if (abs((int8_t)(move_from(move)) - (int8_t)(move_to(move))) == 16) {
+      board->en_passant_square =
+          side == WHITE ? (move_from(move) + 8) : (move_from(move) - 8);
 
-        if (is_promotion(attacked_square, BLACK)) {
-          move_list_push(move_list, move_new(from_square, attacked_square,
-                                             PROMOTION, QUEEN_PROMOTION));
-        } else {
-          move_list_push(move_list,
-                         move_new(from_square, attacked_square, CAPTURE,
-                                  attacked_square == board->en_passant_square
-                                      ? EN_PASSANT_FLAG
-                                      : NO_FLAG));
-        }
+      // we only set en passant square if a pawn can actually capture, as per
+      // https://github.com/fsmosca/PGN-Standard/blob/61a82dab3ff62d79dea82c15a8cc773f80f3a91e/PGN-Standard.txt#L2231-L2242
+      uint64_t enemy_pawns =
+          board->bitboards[side_piece(side ^ 1, WHITE_PAWN)];
+      if ((PAWN_ATTACKS[side][board->en_passant_square] & enemy_pawns) == 0) {
+        board->en_passant_square = NO_SQUARE;
       }
     }
   }
+
+  board->hash ^= zobrist_castle(board->castle_rights);
+  board->castle_rights = board->castle_rights &
+                         CASTLE_PERMISSIONS[move_from(move)] &
+                         CASTLE_PERMISSIONS[move_to(move)];
+  board->hash ^= zobrist_castle(board->castle_rights);
+
+  if (board->en_passant_square != NO_SQUARE) {
+    board->hash ^= zobrist_en_passant_file(board->en_passant_square);
+  }
+
+  board->side = side ^ 1;
+  board->hash ^= zobrist_current_side();
+
+  history_push(board->history, irreversible_state);
+
+  board->ply++;
 }
 
-void generate_knight_captures(const board_t *board, move_list_t *move_list) {
-  uint64_t knights =
-      board->side == WHITE ? board->white_knights : board->black_knights;
+SIDE_SPECIALIZED void unmake_side_move(board_t *board, move_t move,
+                                       side_t side) {
+  history_item_t move_state = history_pop(board->history);
 
-  side_t current_side = board->side;
+  board->ply--;
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+  board->hash = move_state.hash;
+  board->castle_rights = move_state.castle_rights;
+  board->en_passant_square = move_state.en_passant_square;
+  board->halfmove_clock = move_state.halfmove_clock;
+  board->repetition_clock = move_state.repetition_clock;
 
-  while (knights != 0) {
-    square_t from_square = bitboard_pop_bit(&knights);
+  board->side = side;
 
-    uint64_t knight_moves =
-        (KNIGHT_ATTACKS[from_square]) & ~current_side_occupancy;
+  switch (move_move_type(move)) {
+  case QUIET:
+    zobrist_move_piece(board, move_to(move), move_from(move));
+    break;
+  case CAPTURE: {
+    square_t captured_square = move_to(move);
 
-    while (knight_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&knight_moves);
+    if (move_flag(move) == EN_PASSANT_FLAG) {
+      captured_square =
+          side == WHITE ? (move_to(move) - 8) : (move_to(move) + 8);
+    }
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+    zobrist_move_piece(board, move_to(move), move_from(move));
+    zobrist_add_piece(board, captured_square, move_state.captured_piece);
+    break;
+  }
+  case CASTLE: {
+    // the king lands on the g or c file, the rook jumps over it from the h or
+    // a file
+    bool king_side = (move_to(move) & 7) == (G1 & 7);
+    square_t rook_from_square =
+        king_side ? move_to(move) + 1 : move_to(move) - 2;
+    square_t rook_to_square = king_side ? move_to(move) - 1 : move_to(move) + 1;
+
+    zobrist_move_piece(board, move_to(move), move_from(move));
+    zobrist_move_piece(board, rook_to_square, rook_from_square);
+    break;
+  }
+  case PROMOTION: {
+    zobrist_remove_piece(board, move_to(move));
+    zobrist_add_piece(board, move_from(move), move_state.moved_piece);
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      }
+    if (move_state.captured_piece != EMPTY) {
+      zobrist_add_piece(board, move_to(move), move_state.captured_piece);
     }
+    break;
+  }
   }
 }
 
-void generate_bishop_captures(const board_t *board, move_list_t *move_list) {
-  uint64_t bishops =
-      board->side == WHITE ? board->white_bishops : board->black_bishops;
+// moves come from the legal generator, so this doesn't check whether the move
+// leaves the king in check
+void make_move(board_t *board, move_t move) {
+  if (board->side == WHITE) {
+    make_side_move(board, move, WHITE);
+  } else {
+    make_side_move(board, move, BLACK);
+  }
+}
 
-  side_t current_side = board->side;
+void unmake_move(board_t *board, move_t move) {
+  // the side that made the move is the one not on turn now
+  if (board->side == BLACK) {
+    unmake_side_move(board, move, WHITE);
+  } else {
+    unmake_side_move(board, move, BLACK);
+  }
+}
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+// passes the turn without moving anything, for null move pruning
+void make_null_move(board_t *board) {
+  history_item_t irreversible_state = {
+      .hash = board->hash,
+      .castle_rights = board->castle_rights,
+      .en_passant_square = board->en_passant_square,
+      .halfmove_clock = board->halfmove_clock,
+      .repetition_clock = board->repetition_clock,
+      .moved_piece = EMPTY,
+      .captured_piece = EMPTY};
 
-  while (bishops != 0) {
-    square_t from_square = bitboard_pop_bit(&bishops);
+  if (board->en_passant_square != NO_SQUARE) {
+    board->hash ^= zobrist_en_passant_file(board->en_passant_square);
+  }
+  board->en_passant_square = NO_SQUARE;
 
-    uint64_t bishop_moves =
-        (get_bishop_attacks(from_square,
-                            current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+  // positions before a null move can't be repeated by ones after it. the
+  // halfmove clock carries on, a fifty-move draw still counts under one
+  board->repetition_clock = 0;
 
-    while (bishop_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&bishop_moves);
+  board->side ^= 1;
+  board->hash ^= zobrist_current_side();
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  history_push(board->history, irreversible_state);
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
+  board->ply++;
+}
+
+void unmake_null_move(board_t *board) {
+  history_item_t move_state = history_pop(board->history);
+
+  board->ply--;
+
+  board->hash = move_state.hash;
+  board->en_passant_square = move_state.en_passant_square;
+  board->halfmove_clock = move_state.halfmove_clock;
+  board->repetition_clock = move_state.repetition_clock;
+
+  board->side ^= 1;
+}
+
+// how many plies to take off a late quiet move, by depth and by how many moves
+// were searched before it. grows with both, since a move far down a well
+// ordered list at high depth is very unlikely to be the best one
+int LATE_MOVE_REDUCTIONS[MAX_SEARCH_DEPTH][256];
+
+void init_late_move_reductions() {
+  for (int depth = 0; depth < MAX_SEARCH_DEPTH; depth++) {
+    for (int move_number = 0; move_number < 256; move_number++) {
+      if (depth == 0 || move_number == 0) {
+        LATE_MOVE_REDUCTIONS[depth][move_number] = 0;
+        continue;
       }
+
+      double scale = __builtin_log(depth) * __builtin_log(move_number);
+      LATE_MOVE_REDUCTIONS[depth][move_number] = (int)(0.75 + scale / 2.25);
     }
   }
 }
 
-void generate_rook_captures(const board_t *board, move_list_t *move_list) {
-  uint64_t rooks =
-      board->side == WHITE ? board->white_rooks : board->black_rooks;
+void init_all() {
+  init_line_masks();
+  init_zobrist_hash();
+  init_piece_square();
+  init_late_move_reductions();
+}
 
-  side_t current_side = board->side;
+#define TT_EMPTY_FLAG 0
+#define TT_ALPHA_FLAG 1
+#define TT_BETA_FLAG 2
+#define TT_EXACT_FLAG 3
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+// packed into 8 bytes so a whole bucket fits in one cache line. the key is the
+// top 16 bits of the hash, the low bits are already implied by the bucket index
+typedef struct {
+  uint16_t key;
+  // low 16 bits of the move, i.e. everything except the ordering score
+  uint16_t best_move;
+  int16_t score;
+  uint8_t depth;
+  // generation in the top 6 bits, flag in the bottom 2
+  uint8_t generation_and_flag;
+} transposition_table_entry_t;
 
-  while (rooks != 0) {
-    square_t from_square = bitboard_pop_bit(&rooks);
+#define TT_BUCKET_SIZE 8
+
+// entries are kept as plain 64 bit words and always read and written whole, so
+// lazy SMP threads sharing the table can't tear one another's entries. they're
+// unpacked into a transposition_table_entry_t to be looked at
+typedef struct {
+  uint64_t entries[TT_BUCKET_SIZE];
+} transposition_table_bucket_t;
 
-    uint64_t rook_moves =
-        (get_rook_attacks(from_square,
-                          current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+typedef struct {
+  transposition_table_bucket_t *buckets;
+  // bucket count is a power of two, so `hash & mask` picks the bucket
+  size_t mask;
+  uint8_t generation;
+} transposition_table_t;
 
-    while (rook_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&rook_moves);
+#define TT_GENERATION_COUNT 64
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+#define DEFAULT_HASH_MB 64
+#define MAX_HASH_MB 32768
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      }
-    }
-  }
+// below this size a single memset is quicker than starting threads
+#define TT_PARALLEL_CLEAR_MIN_MB 256
+
+uint8_t tt_entry_flag(const transposition_table_entry_t *entry) {
+  return entry->generation_and_flag & 0x03;
 }
 
-void generate_queen_captures(const board_t *board, move_list_t *move_list) {
-  uint64_t queens =
-      board->side == WHITE ? board->white_queens : board->black_queens;
+uint8_t tt_entry_generation(const transposition_table_entry_t *entry) {
+  return entry->generation_and_flag >> 2;
+}
 
-  side_t current_side = board->side;
+uint16_t tt_key(uint64_t hash) { return hash >> 48; }
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+transposition_table_entry_t tt_entry_load(const uint64_t *slot) {
+  uint64_t data = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  transposition_table_entry_t entry;
+  memcpy(&entry, &data, sizeof(entry));
+  return entry;
+}
 
-  while (queens != 0) {
-    square_t from_square = bitboard_pop_bit(&queens);
+void tt_entry_store(uint64_t *slot, const transposition_table_entry_t *entry) {
+  uint64_t data;
+  memcpy(&data, entry, sizeof(data));
+  __atomic_store_n(slot, data, __ATOMIC_RELAXED);
+}
 
-    uint64_t queen_moves =
-        (get_queen_attacks(from_square,
-                           current_side_occupancy | enemy_occupancy)) &
-        ~current_side_occupancy;
+size_t transposition_table_bucket_count(const transposition_table_t *table) {
+  return table->mask + 1;
+}
 
-    while (queen_moves != 0) {
-      square_t to_square = bitboard_pop_bit(&queen_moves);
+typedef struct {
+  transposition_table_bucket_t *buckets;
+  size_t count;
+} transposition_table_clear_job_t;
 
-      bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+void *transposition_table_clear_chunk(void *arg) {
+  transposition_table_clear_job_t *job = arg;
+  memset(job->buckets, 0, job->count * sizeof(transposition_table_bucket_t));
+  return NULL;
+}
 
-      if (is_capture) {
-        move_list_push(move_list,
-                       move_new(from_square, to_square, CAPTURE, NO_FLAG));
-      }
-    }
+// zeroes every entry. large tables are split into one chunk per thread, which
+// also makes each thread fault in its own share of the pages
+void transposition_table_clear(transposition_table_t *table, int thread_count) {
+  size_t bucket_count = transposition_table_bucket_count(table);
+  size_t size_in_mb =
+      bucket_count * sizeof(transposition_table_bucket_t) / (1024 * 1024);
+
+  table->generation = 0;
+
+  if (thread_count <= 1 || size_in_mb < TT_PARALLEL_CLEAR_MIN_MB) {
+    memset(table->buckets, 0,
+           bucket_count * sizeof(transposition_table_bucket_t));
+    return;
   }
-}
 
-void generate_king_captures(const board_t *board, move_list_t *move_list) {
-  uint64_t king = board->side == WHITE ? board->white_king : board->black_king;
+  pthread_t threads[MAX_SEARCH_THREADS];
+  transposition_table_clear_job_t jobs[MAX_SEARCH_THREADS];
 
-  side_t current_side = board->side;
+  size_t chunk_size = bucket_count / thread_count;
 
-  uint64_t current_side_occupancy = board->occupancies[current_side];
-  uint64_t enemy_occupancy = board->occupancies[current_side ^ 1];
+  for (int i = 0; i < thread_count; i++) {
+    jobs[i].buckets = table->buckets + i * chunk_size;
+    jobs[i].count =
+        i == thread_count - 1 ? bucket_count - i * chunk_size : chunk_size;
+    pthread_create(&threads[i], NULL, transposition_table_clear_chunk,
+                   &jobs[i]);
+  }
 
-  square_t from_square = bitboard_pop_bit(&king);
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
 
-  uint64_t king_moves = KING_ATTACKS[from_square] & ~current_side_occupancy;
+// rounds down to a power of two number of buckets, so the table can end up
+// using less than the requested size
+void transposition_table_allocate(transposition_table_t *table,
+                                  int size_in_mb) {
+  size_t max_buckets = (size_t)size_in_mb * 1024 * 1024 /
+                       sizeof(transposition_table_bucket_t);
 
-  while (king_moves != 0) {
-    square_t to_square = bitboard_pop_bit(&king_moves);
+  size_t bucket_count = 1;
+  while (bucket_count * 2 <= max_buckets) {
+    bucket_count *= 2;
+  }
 
-    bool is_capture = ((1ULL << to_square) & enemy_occupancy) != 0;
+  table->mask = bucket_count - 1;
 
-    if (is_capture) {
-      move_list_push(move_list,
-                     move_new(from_square, to_square, CAPTURE, NO_FLAG));
-    }
+  void *buckets = NULL;
+  if (posix_memalign(&buckets, sizeof(transposition_table_bucket_t),
+                     bucket_count * sizeof(transposition_table_bucket_t)) !=
+      0) {
+    printf("Failed to allocate %d MB transposition table\n", size_in_mb);
+    exit(EXIT_FAILURE);
   }
-}
 
-void generate_all_captures(const board_t *board, move_list_t *move_list) {
-  generate_pawn_captures(board, move_list);
-  generate_knight_captures(board, move_list);
-  generate_bishop_captures(board, move_list);
-  generate_rook_captures(board, move_list);
-  generate_queen_captures(board, move_list);
-  generate_king_captures(board, move_list);
+  table->buckets = buckets;
 }
 
-bool is_in_check(board_t *board, side_t side) {
-  uint64_t king_bitboard =
-      side == WHITE ? board->white_king : board->black_king;
+transposition_table_t *transposition_table_new(int size_in_mb) {
+  transposition_table_t *table = malloc(sizeof(transposition_table_t));
 
-  square_t king_position = __builtin_ctzll(get_lsb(king_bitboard));
+  transposition_table_allocate(table, size_in_mb);
+  transposition_table_clear(table, 1);
 
-  return is_square_attacked(king_position, board, side ^ 1);
+  return table;
 }
 
-bool make_move(board_t *board, move_t move) {
-  history_item_t irreversible_state = {
-      .hash = board->hash,
-      .castle_rights = board->castle_rights,
-      .en_passant_square = board->en_passant_square,
-      .halfmove_clock = board->halfmove_clock,
-      .moved_piece = board->pieces[move_from(move)],
-      .captured_piece = board->pieces[move_to(move)]};
+void transposition_table_resize(transposition_table_t *table, int size_in_mb,
+                                int thread_count) {
+  free(table->buckets);
+  transposition_table_allocate(table, size_in_mb);
+  transposition_table_clear(table, thread_count);
+}
 
-  board->halfmove_clock++;
+void transposition_table_free(transposition_table_t *table) {
+  free(table->buckets);
+  free(table);
+}
 
-  // TODO: could this be lower down?
-  // clear en passant
-  board->hash ^= zobrist_en_passant_file(board->en_passant_square);
-  board->en_passant_square = NO_SQUARE;
+// called once per `go`, so entries from earlier searches age out
+void transposition_table_new_search(transposition_table_t *table) {
+  table->generation = (table->generation + 1) % TT_GENERATION_COUNT;
+}
 
-  board->hash ^= zobrist_remove_piece(board, move_from(move));
+// copies the entry for this position into `entry`, returns false if it isn't
+// in the table
+bool transposition_table_probe(const transposition_table_t *table,
+                               uint64_t hash,
+                               transposition_table_entry_t *entry) {
+  const transposition_table_bucket_t *bucket =
+      &table->buckets[hash & table->mask];
+  uint16_t key = tt_key(hash);
 
-  switch (move_move_type(move)) {
-  case QUIET:
-    board->hash ^=
-        zobrist_add_piece(board, move_to(move), irreversible_state.moved_piece);
-    break;
-  case CAPTURE: {
-    if (move_flag(move) == EN_PASSANT_FLAG) {
-      square_t captured_square =
-          board->side == WHITE ? (move_to(move) - 8) : (move_to(move) + 8);
-      irreversible_state.captured_piece = board->pieces[captured_square];
+  for (int i = 0; i < TT_BUCKET_SIZE; i++) {
+    *entry = tt_entry_load(&bucket->entries[i]);
 
-      board->hash ^= zobrist_remove_piece(board, captured_square);
-      board->hash ^= zobrist_add_piece(board, move_to(move),
-                                       irreversible_state.moved_piece);
-    } else {
-      board->hash ^= zobrist_remove_piece(board, move_to(move));
-      board->hash ^= zobrist_add_piece(board, move_to(move),
-                                       irreversible_state.moved_piece);
+    if (entry->key == key && tt_entry_flag(entry) != TT_EMPTY_FLAG) {
+      return true;
     }
-    break;
   }
-  case CASTLE: {
-    square_t rook_from_square;
-    square_t rook_to_square;
-
-    if (move_to(move) == G1) {
-      rook_from_square = H1;
-      rook_to_square = F1;
-    } else if (move_to(move) == C1) {
-      rook_from_square = A1;
-      rook_to_square = D1;
-    } else if (move_to(move) == G8) {
-      rook_from_square = H8;
-      rook_to_square = F8;
-    } else if (move_to(move) == C8) {
-      rook_from_square = A8;
-      rook_to_square = D8;
-    } else {
-      printf("Invalid rook move\n");
-      exit(EXIT_FAILURE);
-    }
 
-    // move the king
-    board->hash ^=
-        zobrist_add_piece(board, move_to(move), irreversible_state.moved_piece);
+  return false;
+}
 
-    // move the rook
-    board->hash ^= zobrist_add_piece(
-        board, rook_to_square, board->side == WHITE ? WHITE_ROOK : BLACK_ROOK);
-    board->hash ^= zobrist_remove_piece(board, rook_from_square);
+// how many searches ago the entry was written
+int tt_entry_age(const transposition_table_t *table,
+                 const transposition_table_entry_t *entry) {
+  return (TT_GENERATION_COUNT + table->generation -
+          tt_entry_generation(entry)) %
+         TT_GENERATION_COUNT;
+}
 
-    break;
+void transposition_table_store(transposition_table_t *table, uint64_t hash,
+                               int depth, int ply, int score, move_t best_move,
+                               uint8_t flag) {
+  if (score > CHECKMATE) {
+    score += ply;
   }
-  case PROMOTION: {
-    if (irreversible_state.captured_piece != EMPTY) {
-      board->hash ^= zobrist_remove_piece(board, move_to(move));
-    }
 
-    piece_t promotion_piece = EMPTY;
+  if (score < -CHECKMATE) {
+    score -= ply;
+  }
 
-    if (move_flag(move) == KNIGHT_PROMOTION) {
-      promotion_piece = board->side == WHITE ? WHITE_KNIGHT : BLACK_KNIGHT;
-    }
+  transposition_table_bucket_t *bucket = &table->buckets[hash & table->mask];
+  uint16_t key = tt_key(hash);
 
-    if (move_flag(move) == BISHOP_PROMOTION) {
-      promotion_piece = board->side == WHITE ? WHITE_BISHOP : BLACK_BISHOP;
-    }
+  // prefer the slot already holding this position, then an empty one, then
+  // whichever entry is the shallowest once its age is taken into account
+  uint64_t *replace_slot = &bucket->entries[0];
+  transposition_table_entry_t replace = tt_entry_load(replace_slot);
+  int replace_worth = INT32_MAX;
 
-    if (move_flag(move) == ROOK_PROMOTION) {
-      promotion_piece = board->side == WHITE ? WHITE_ROOK : BLACK_ROOK;
-    }
+  for (int i = 0; i < TT_BUCKET_SIZE; i++) {
+    transposition_table_entry_t entry = tt_entry_load(&bucket->entries[i]);
 
-    if (move_flag(move) == QUEEN_PROMOTION) {
-      promotion_piece = board->side == WHITE ? WHITE_QUEEN : BLACK_QUEEN;
+    if (tt_entry_flag(&entry) == TT_EMPTY_FLAG || entry.key == key) {
+      replace_slot = &bucket->entries[i];
+      replace = entry;
+      break;
     }
 
-    if (promotion_piece == EMPTY) {
-      printf("Expected promotion flag\n");
-      exit(EXIT_FAILURE);
+    int worth = entry.depth - 8 * tt_entry_age(table, &entry);
+    if (worth < replace_worth) {
+      replace_slot = &bucket->entries[i];
+      replace = entry;
+      replace_worth = worth;
     }
-
-    board->hash ^= zobrist_add_piece(board, move_to(move), promotion_piece);
-    break;
-  }
   }
 
-  if (irreversible_state.moved_piece == WHITE_PAWN ||
-      irreversible_state.moved_piece == BLACK_PAWN) {
-    // pawn moves reset fifty-move rule clock
-    board->halfmove_clock = 0;
-
-    // double pawn push
-    if (abs((int8_t)(move_from(move)) - (int8_t)(move_to(move))) == 16) {
-      board->en_passant_square =
-          board->side == WHITE ? (move_from(move) + 8) : (move_from(move) - 8);
-
-      // we only set en passant square if a pawn can actually capture, as per
-      // https://github.com/fsmosca/PGN-Standard/blob/61a82dab3ff62d79dea82c15a8cc773f80f3a91e/PGN-Standard.txt#L2231-L2242
-      uint64_t enemy_pawns =
-          board->side == WHITE ? board->black_pawns : board->white_pawns;
-      if ((PAWN_ATTACKS[board->side][board->en_passant_square] & enemy_pawns) ==
-          0) {
-        board->en_passant_square = NO_SQUARE;
-      }
+  // don't let a shallow search overwrite a deeper result for the same position
+  // from this search, unless it's an exact score
+  if (replace.key == key && tt_entry_flag(&replace) != TT_EMPTY_FLAG &&
+      tt_entry_age(table, &replace) == 0 && flag != TT_EXACT_FLAG &&
+      depth < replace.depth) {
+    // still worth remembering a move if the old entry doesn't have one
+    if (replace.best_move == 0) {
+      replace.best_move = best_move & 0xFFFF;
+      tt_entry_store(replace_slot, &replace);
     }
+    return;
   }
 
-  board->hash ^= zobrist_castle(board->castle_rights);
-  board->castle_rights = board->castle_rights &
-                         CASTLE_PERMISSIONS[move_from(move)] &
-                         CASTLE_PERMISSIONS[move_to(move)];
-  board->hash ^= zobrist_castle(board->castle_rights);
+  replace.key = key;
+  replace.best_move = best_move & 0xFFFF;
+  replace.score = score;
+  replace.depth = depth;
+  replace.generation_and_flag = (table->generation << 2) | flag;
+  tt_entry_store(replace_slot, &replace);
+}
 
-  if (board->en_passant_square != NO_SQUARE) {
-    board->hash ^= zobrist_en_passant_file(board->en_passant_square);
+// permill of sampled entries written by the current search, for `hashfull`
+int transposition_table_hashfull(const transposition_table_t *table) {
+  size_t bucket_count = transposition_table_bucket_count(table);
+  size_t sample = 1000 / TT_BUCKET_SIZE;
+  if (sample > bucket_count) {
+    sample = bucket_count;
   }
 
-  board->side ^= 1;
-  board->hash ^= zobrist_current_side();
+  int used = 0;
 
-  board->history[board->history_length] = irreversible_state;
-  board->history_length++;
+  for (size_t i = 0; i < sample; i++) {
+    for (int j = 0; j < TT_BUCKET_SIZE; j++) {
+      transposition_table_entry_t entry =
+          tt_entry_load(&table->buckets[i].entries[j]);
 
-  board->ply++;
+      if (tt_entry_flag(&entry) != TT_EMPTY_FLAG &&
+          tt_entry_age(table, &entry) == 0) {
+        used++;
+      }
+    }
+  }
 
-  return !is_in_check(board, board->side ^ 1);
+  return used * 1000 / (int)(sample * TT_BUCKET_SIZE);
 }
 
-void unmake_move(board_t *board, move_t move) {
-  board->history_length--;
-  history_item_t move_state = board->history[board->history_length];
+// attempts to read from and populate values from TT entry
+// returns true if it succeeds
+bool transposition_table_entry_get(const transposition_table_entry_t *entry,
+                                   int depth, int ply, int alpha, int beta,
+                                   move_t *best_move, int *score) {
+  if (entry == NULL) {
+    return false;
+  }
 
-  board->ply--;
+  *best_move = entry->best_move;
 
-  board->hash = move_state.hash;
-  board->castle_rights = move_state.castle_rights;
-  board->en_passant_square = move_state.en_passant_square;
-  board->halfmove_clock = move_state.halfmove_clock;
+  if (entry->depth >= depth) {
+    *score = entry->score;
 
-  board->side ^= 1;
+    if (*score > CHECKMATE) {
+      *score -= ply;
+    }
 
-  zobrist_add_piece(board, move_from(move), move_state.moved_piece);
+    if (*score < -CHECKMATE) {
+      *score += ply;
+    }
 
-  switch (move_move_type(move)) {
-  case QUIET:
-    zobrist_remove_piece(board, move_to(move));
-    break;
-  case CAPTURE: {
-    if (move_flag(move) == EN_PASSANT_FLAG) {
-      square_t captured_square =
-          board->side == WHITE ? (move_to(move) - 8) : (move_to(move) + 8);
+    uint8_t flag = tt_entry_flag(entry);
 
-      zobrist_remove_piece(board, move_to(move));
-      zobrist_add_piece(board, captured_square, move_state.captured_piece);
-    } else {
-      zobrist_remove_piece(board, move_to(move));
-      zobrist_add_piece(board, move_to(move), move_state.captured_piece);
-    }
-    break;
-  }
-  case CASTLE: {
-    square_t rook_from_square;
-    square_t rook_to_square;
-
-    if (move_to(move) == G1) {
-      rook_from_square = H1;
-      rook_to_square = F1;
-    } else if (move_to(move) == C1) {
-      rook_from_square = A1;
-      rook_to_square = D1;
-    } else if (move_to(move) == G8) {
-      rook_from_square = H8;
-      rook_to_square = F8;
-    } else if (move_to(move) == C8) {
-      rook_from_square = A8;
-      rook_to_square = D8;
-    } else {
-      printf("Invalid rook move\n");
-      exit(EXIT_FAILURE);
+    if (flag == TT_ALPHA_FLAG && *score <= alpha) {
+      *score = alpha;
+      return true;
     }
 
-    // remove the king
-    zobrist_remove_piece(board, move_to(move));
+    if (flag == TT_BETA_FLAG && *score >= beta) {
+      *score = beta;
+      return true;
+    }
 
-    // move the rook back
-    zobrist_remove_piece(board, rook_to_square);
-    zobrist_add_piece(board, rook_from_square,
-                      board->side == WHITE ? WHITE_ROOK : BLACK_ROOK);
-    break;
-  }
-  case PROMOTION: {
-    zobrist_remove_piece(board, move_to(move));
-    if (move_state.captured_piece != EMPTY) {
-      zobrist_add_piece(board, move_to(move), move_state.captured_piece);
+    if (flag == TT_EXACT_FLAG) {
+      return true;
     }
-    break;
   }
-  }
-}
 
-void init_all() {
-  init_attack_masks();
-  init_zobrist_hash();
+  return false;
 }
 
-#define TT_PERFT_FLAG 0
-#define TT_ALPHA_FLAG 1
-#define TT_BETA_FLAG 2
-#define TT_EXACT_FLAG 3
+// perft keeps its own table, it needs full node counts rather than scores.
+// threads share it without locks: the key is stored xored with the data, so an
+// entry torn by two threads writing at once fails the key check instead of
+// handing back a wrong count
+typedef struct {
+  uint64_t key;
+  uint64_t data;
+} perft_table_entry_t;
 
 typedef struct {
-  uint64_t hash;
-  uint64_t nodes;
-  int depth;
+  perft_table_entry_t *entries;
+  size_t mask;
+} perft_table_t;
 
-  // only used in search (not perft)
-  int score;
-  uint8_t flag;
-  uint64_t best_move;
-} transposition_table_entry_t;
+// rounds down to a power of two number of entries
+perft_table_t *perft_table_new(int size_in_mb) {
+  perft_table_t *table = malloc(sizeof(perft_table_t));
 
-typedef struct {
-  transposition_table_entry_t *entries;
-  size_t size;
-} transposition_table_t;
+  size_t max_entries =
+      (size_t)size_in_mb * 1024 * 1024 / sizeof(perft_table_entry_t);
+  size_t size = 1;
 
-transposition_table_t *transposition_table_new(int size_in_mb) {
-  transposition_table_t *table = malloc(sizeof(transposition_table_t));
+  while (size * 2 <= max_entries) {
+    size *= 2;
+  }
 
-  size_t size = size_in_mb * 1024 * 1024 / sizeof(transposition_table_entry_t);
+  table->mask = size - 1;
+  table->entries = calloc(size, sizeof(perft_table_entry_t));
 
-  table->size = size;
-  table->entries = malloc(size * sizeof(transposition_table_entry_t));
+  if (table->entries == NULL) {
+    printf("Failed to allocate %d MB for the perft table\n", size_in_mb);
+    exit(EXIT_FAILURE);
+  }
 
   return table;
 }
 
-transposition_table_entry_t *
-transposition_table_probe(transposition_table_t *table, uint64_t hash) {
-  size_t index = hash % table->size;
-  return &table->entries[index];
+void perft_table_free(perft_table_t *table) {
+  free(table->entries);
+  free(table);
 }
 
-void transposition_table_store(transposition_table_t *table, uint64_t hash,
-                               uint64_t nodes, int depth, int ply, int score,
-                               uint64_t best_move, uint8_t flag) {
-  if (score > CHECKMATE) {
-    score += ply;
-  }
+// data packs the node count above an 8 bit depth
+bool perft_table_probe(const perft_table_t *table, uint64_t hash, int depth,
+                       uint64_t *nodes) {
+  const perft_table_entry_t *entry = &table->entries[hash & table->mask];
 
-  if (score < -CHECKMATE) {
-    score -= -ply;
+  uint64_t key = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+  uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+  if ((key ^ data) != hash || (int)(data & 0xFF) != depth) {
+    return false;
   }
 
-  size_t index = hash % table->size;
+  *nodes = data >> 8;
+  return true;
+}
 
-  table->entries[index].nodes = nodes;
-  table->entries[index].hash = hash;
-  table->entries[index].depth = depth;
+void perft_table_store(perft_table_t *table, uint64_t hash, int depth,
+                       uint64_t nodes) {
+  perft_table_entry_t *entry = &table->entries[hash & table->mask];
+  uint64_t data = (nodes << 8) | (uint64_t)depth;
 
-  table->entries[index].score = score;
-  table->entries[index].best_move = best_move;
-  table->entries[index].flag = flag;
+  __atomic_store_n(&entry->key, hash ^ data, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
 }
 
-// attempts to read from and populate values from TT entry
-// returns true if it succeeds
-bool transposition_table_entry_get(transposition_table_entry_t *entry,
-                                   uint64_t hash, int depth, int ply, int alpha,
-                                   int beta, move_t *best_move, int *score) {
-  if (entry->hash == hash) {
-    *best_move = entry->best_move;
+uint64_t perft(board_t *board, int depth, perft_table_t *table) {
+  if (depth == 0) {
+    return 1;
+  }
 
-    if (entry->depth >= depth) {
-      *score = entry->score;
+  move_list_t move_list;
+  move_list_reset(&move_list);
 
-      if (*score > CHECKMATE) {
-        *score -= ply;
-      }
+  // every generated move is legal, so the last ply only needs counting
+  if (depth == 1) {
+    generate_all_moves(board, &move_list);
+    return move_list.count;
+  }
 
-      if (*score < -CHECKMATE) {
-        *score += ply;
-      }
+  uint64_t nodes = 0;
 
-      if (entry->flag == TT_ALPHA_FLAG && *score <= alpha) {
-        *score = alpha;
-        return true;
-      }
+  if (perft_table_probe(table, board->hash, depth, &nodes)) {
+    return nodes;
+  }
 
-      if (entry->flag == TT_BETA_FLAG && *score >= beta) {
-        *score = beta;
-        return true;
-      }
+  generate_all_moves(board, &move_list);
 
-      if (entry->flag == TT_EXACT_FLAG) {
-        return true;
-      }
+  move_t move;
+
+  for (int i = 0; i < move_list.count; i++) {
+    move = move_list.moves[i];
+    make_move(board, move);
+    nodes += perft(board, depth - 1, table);
+    unmake_move(board, move);
+  }
+
+  perft_table_store(table, board->hash, depth, nodes);
+
+  return nodes;
+}
+
+typedef struct {
+  pthread_t thread;
+  board_t board;
+  perft_table_t *table;
+  int depth;
+  const move_list_t *root_moves;
+  uint64_t *root_nodes;
+  size_t *next_root_move;
+} perft_worker_t;
+
+// takes the next unclaimed root move until there are none left, so a thread
+// that drew a small subtree goes back for more instead of sitting idle
+void *perft_worker(void *arg) {
+  perft_worker_t *worker = arg;
+
+  while (1) {
+    size_t i =
+        __atomic_fetch_add(worker->next_root_move, 1, __ATOMIC_RELAXED);
+
+    if (i >= worker->root_moves->count) {
+      break;
     }
+
+    move_t move = worker->root_moves->moves[i];
+    make_move(&worker->board, move);
+    worker->root_nodes[i] =
+        perft(&worker->board, worker->depth - 1, worker->table);
+    unmake_move(&worker->board, move);
   }
 
-  return false;
+  return NULL;
 }
 
-uint64_t perft(board_t *board, int depth, transposition_table_t *table) {
-  if (depth == 0) {
+// splits the root moves across `thread_count` threads sharing one table.
+// fills `root_moves` and the node count under each of them in `root_nodes`
+uint64_t perft_parallel(const board_t *board, int depth, perft_table_t *table,
+                        int thread_count, move_list_t *root_moves,
+                        uint64_t *root_nodes) {
+  move_list_reset(root_moves);
+
+  if (depth <= 0) {
     return 1;
   }
 
-  transposition_table_entry_t *entry =
-      transposition_table_probe(table, board->hash);
+  generate_all_moves(board, root_moves);
 
-  if (entry->hash == board->hash && entry->depth == depth) {
-    return entry->nodes;
+  if (thread_count < 1) {
+    thread_count = 1;
+  } else if (thread_count > MAX_SEARCH_THREADS) {
+    thread_count = MAX_SEARCH_THREADS;
   }
 
-  uint64_t nodes = 0;
+  size_t next_root_move = 0;
+  perft_worker_t *workers = malloc(thread_count * sizeof(perft_worker_t));
+
+  for (int i = 0; i < thread_count; i++) {
+    workers[i].board = *board;
+    workers[i].board.history = history_clone(board->history);
+    workers[i].table = table;
+    workers[i].depth = depth;
+    workers[i].root_moves = root_moves;
+    workers[i].root_nodes = root_nodes;
+    workers[i].next_root_move = &next_root_move;
+  }
 
-  move_list_t *move_list = move_list_new();
-  generate_all_moves(board, move_list);
+  // the calling thread works too rather than waiting on the others
+  for (int i = 1; i < thread_count; i++) {
+    pthread_create(&workers[i].thread, NULL, perft_worker, &workers[i]);
+  }
 
-  move_t move;
+  perft_worker(&workers[0]);
 
-  for (int i = 0; i < move_list->count; i++) {
-    move = move_list->moves[i];
-    if (make_move(board, move)) {
-      nodes += perft(board, depth - 1, table);
-    }
+  for (int i = 1; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
 
-    unmake_move(board, move);
+  for (int i = 0; i < thread_count; i++) {
+    history_free(workers[i].board.history);
   }
 
-  transposition_table_store(table, board->hash, nodes, depth, 0, 0, 0ULL,
-                            TT_PERFT_FLAG);
+  free(workers);
 
-  free(move_list);
+  uint64_t nodes = 0;
+
+  for (size_t i = 0; i < root_moves->count; i++) {
+    nodes += root_nodes[i];
+  }
 
   return nodes;
 }
@@ -2287,55 +2510,122 @@ int get_time_ms() {
   return t.tv_sec * 1000 + t.tv_usec / 1000;
 }
 
-// void perft_test(board_t *board, int depth, transposition_table_t *table) {
-//   printf("\nStarting Test To Depth:%d\n", depth);
-//   int start = get_time_ms();
-//
-//   uint64_t nodes = 0;
-//   int move_num = 0;
-//
-//   move_list_t *move_list = move_list_new();
-//
-//   generate_all_moves(board, move_list);
-//
-//   move_t move;
-//
-//   for (int i = 0; i < move_list->count; i++) {
-//     move = move_list->moves[i];
-//     if (make_move(board, move)) {
-//       move_num++;
-//       uint64_t old_nodes = nodes;
-//       nodes += perft(board, depth - 1, table);
-//       printf("move %d : %s%s : %ld\n", move_num,
-//       SQUARE_TO_READABLE[move_from(move)],
-//              SQUARE_TO_READABLE[move_to(move)], nodes - old_nodes);
-//     }
-//
-//     unmake_move(board, move);
-//   }
-//
-//   free(move_list);
-//
-//   printf("\nTest Complete : %ld nodes visited in %dms\n", nodes,
-//          get_time_ms() - start);
-//
-//   return;
-// }
-
-void run_perft_suite() {
-  FILE *perft_file = fopen("perft.epd", "r");
+#define PERFT_TABLE_MB 128
 
-  char line[256];
-  char fens[256][100];
-  int depths[256];
-  uint64_t nodes[256];
-  size_t line_count = 0;
+// prints the node count under each root move, so a mismatch can be chased
+// down by comparing against another engine's divide
+void perft_test(const board_t *board, int depth, int thread_count) {
+  // `perft` only stops at exactly zero, so a negative depth would never end
+  if (depth < 1) {
+    printf("Perft depth must be at least 1\n");
+    return;
+  }
 
-  transposition_table_t *table = transposition_table_new(128);
+  perft_table_t *table = perft_table_new(PERFT_TABLE_MB);
+  move_list_t root_moves;
+  uint64_t root_nodes[256];
 
   int start = get_time_ms();
+  uint64_t nodes = perft_parallel(board, depth, table, thread_count,
+                                  &root_moves, root_nodes);
+  int time = get_time_ms() - start;
+
+  for (size_t i = 0; i < root_moves.count; i++) {
+    move_print_uci(root_moves.moves[i]);
+    printf(": %lu\n", root_nodes[i]);
+  }
+
+  printf("\nNodes searched: %lu\n", nodes);
+  printf("Time: %dms\n", time);
+  printf("NPS: %lu\n", nodes * 1000 / (time ? time : 1));
+
+  perft_table_free(table);
+}
+
+#define MAX_PERFT_SUITE_POSITIONS 256
+
+typedef struct {
+  char fen[100];
+  int depth;
+  uint64_t expected_nodes;
+  uint64_t nodes;
+  int time;
+} perft_suite_position_t;
+
+typedef struct {
+  perft_suite_position_t *positions;
+  size_t count;
+  size_t *next_position;
+  size_t *finished;
+  perft_table_t *table;
+  pthread_mutex_t *print_lock;
+} perft_suite_worker_t;
+
+void perft_suite_print_result(const perft_suite_position_t *position,
+                              size_t index, size_t finished, size_t count) {
+  printf("\033[36m[Perft test %zu/%zu]\033[0m #%zu depth %d, %lu nodes, %dms, "
+         "%lu nps",
+         finished, count, index + 1, position->depth, position->nodes,
+         position->time,
+         position->nodes * 1000 / (position->time ? position->time : 1));
+
+  if (position->nodes == position->expected_nodes) {
+    printf("\033[32m Passed\033[0m\n");
+  } else {
+    printf("\033[31m Failed (expected %lu)\033[0m\n",
+           position->expected_nodes);
+  }
+}
+
+void *perft_suite_worker(void *arg) {
+  perft_suite_worker_t *worker = arg;
+
+  while (1) {
+    size_t i = __atomic_fetch_add(worker->next_position, 1, __ATOMIC_RELAXED);
+
+    if (i >= worker->count) {
+      break;
+    }
+
+    perft_suite_position_t *position = &worker->positions[i];
+    board_t *board = board_new();
+    board_parse_FEN(board, position->fen);
 
-  while (fgets(line, sizeof(line), perft_file)) {
+    int start = get_time_ms();
+    position->nodes = perft(board, position->depth, worker->table);
+    position->time = get_time_ms() - start;
+
+    board_free(board);
+
+    pthread_mutex_lock(worker->print_lock);
+    (*worker->finished)++;
+    perft_suite_print_result(position, i, *worker->finished, worker->count);
+    fflush(stdout);
+    pthread_mutex_unlock(worker->print_lock);
+  }
+
+  return NULL;
+}
+
+// runs every position in perft.epd to its deepest listed depth. positions are
+// handed out to `thread_count` threads sharing one table, so results are
+// printed in the order they finish. a missing file or a failed position is
+// reported without taking the UCI loop down with it
+void run_perft_suite(int thread_count) {
+  FILE *perft_file = fopen("perft.epd", "r");
+
+  if (perft_file == NULL) {
+    printf("Failed to open perft.epd\n");
+    return;
+  }
+
+  char line[256];
+  perft_suite_position_t *positions =
+      calloc(MAX_PERFT_SUITE_POSITIONS, sizeof(perft_suite_position_t));
+  size_t line_count = 0;
+
+  while (line_count < MAX_PERFT_SUITE_POSITIONS &&
+         fgets(line, sizeof(line), perft_file)) {
     char fen[100];
     size_t fen_size = 0;
 
@@ -2367,33 +2657,44 @@ void run_perft_suite() {
       }
     }
 
-    strcpy(fens[line_count], fen);
-    depths[line_count] = depth;
-    nodes[line_count] = expected_nodes;
+    strcpy(positions[line_count].fen, fen);
+    positions[line_count].depth = depth;
+    positions[line_count].expected_nodes = expected_nodes;
 
     line_count++;
   }
 
-  for (size_t i = 0; i < line_count; i++) {
-    board_t *board = board_new();
-    board_parse_FEN(board, fens[i]);
-    uint64_t expected_nodes = nodes[i];
-    int depth = depths[i];
-    printf("\033[36m[Perft test %zu/%zu]\033[0m expected nodes: %lu, depth: "
-           "%d",
-           i + 1, line_count, expected_nodes, depth);
-    fflush(stdout);
-    uint64_t result = perft(board, depths[i], table);
-    printf("\r\033[36m[Perft test %zu/%zu]\033[0m expected nodes: %lu, depth: "
-           "%d",
-           i + 1, line_count, expected_nodes, depth);
-    if (expected_nodes == result) {
-      printf("\033[32m Passed\033[0m\n");
-    } else {
-      printf("\033[31m Failed (got %lu)\033[0m\n", result);
-      exit(EXIT_FAILURE);
-    }
-    free(board);
+  fclose(perft_file);
+
+  if (thread_count < 1) {
+    thread_count = 1;
+  } else if (thread_count > MAX_SEARCH_THREADS) {
+    thread_count = MAX_SEARCH_THREADS;
+  }
+
+  perft_table_t *table = perft_table_new(PERFT_TABLE_MB);
+  pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+  size_t next_position = 0;
+  size_t finished = 0;
+
+  pthread_t threads[MAX_SEARCH_THREADS];
+  perft_suite_worker_t worker = {.positions = positions,
+                                 .count = line_count,
+                                 .next_position = &next_position,
+                                 .finished = &finished,
+                                 .table = table,
+                                 .print_lock = &print_lock};
+
+  int start = get_time_ms();
+
+  for (int i = 1; i < thread_count; i++) {
+    pthread_create(&threads[i], NULL, perft_suite_worker, &worker);
+  }
+
+  perft_suite_worker(&worker);
+
+  for (int i = 1; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
   }
 
   int end = get_time_ms() - start;
@@ -2403,11 +2704,33 @@ void run_perft_suite() {
 
   float precise_seconds = seconds + ((float)milliseconds / 1000);
 
-  printf("\n\033[32mAll tests passed in %dm %.1fs\033[0m\n", minutes,
+  uint64_t total_nodes = 0;
+  size_t failed = 0;
+
+  for (size_t i = 0; i < line_count; i++) {
+    total_nodes += positions[i].nodes;
+    failed += positions[i].nodes != positions[i].expected_nodes;
+  }
+
+  free(positions);
+  perft_table_free(table);
+
+  printf("\n%lu nodes, %lu nps with %d threads\n", total_nodes,
+         total_nodes * 1000 / (end ? end : 1), thread_count);
+
+  if (failed > 0) {
+    printf("\033[31m%zu/%zu tests failed in %dm %.1fs\033[0m\n", failed,
+           line_count, minutes, precise_seconds);
+    return;
+  }
+
+  printf("\033[32mAll tests passed in %dm %.1fs\033[0m\n", minutes,
          precise_seconds);
 }
 
-int evaluate_position(board_t *board) {
+// recomputes the evaluation from scratch, only used to check the incremental
+// one in debug builds
+int evaluate_position_full(board_t *board) {
   int multiplier = board->side == WHITE ? 1 : -1;
 
   int white_score = 0;
@@ -2455,6 +2778,29 @@ int evaluate_position(board_t *board) {
   return (white_score - black_score) * multiplier;
 }
 
+int evaluate_position(board_t *board) {
+  int multiplier = board->side == WHITE ? 1 : -1;
+
+  int white_score =
+      board->material[WHITE] + board->piece_square_score[WHITE];
+  int black_score =
+      board->material[BLACK] + board->piece_square_score[BLACK];
+
+  int score = (white_score - black_score) * multiplier;
+
+#ifdef DEBUG
+  int full_score = evaluate_position_full(board);
+  if (score != full_score) {
+    printf("Incremental evaluation %d doesn't match full evaluation %d\n",
+           score, full_score);
+    board_print(board);
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+  return score;
+}
+
 void check_search_time(search_info_t *info) {
   if (info->time_left == INFINITE_SEARCH_TIME &&
       info->move_time == INFINITE_SEARCH_TIME) {
@@ -2490,10 +2836,10 @@ void score_moves(board_t *board, search_info_t *search_info,
       piece_t moved = board->pieces[move_from(move)];
       move_set_score(&move, 20000 + MVV_LVA[captured % 6][moved % 6]);
     } else if (are_moves_equal(move,
-                               search_info->killer_moves[board->ply][0])) {
+                               search_info->stack[board->ply].killer_moves[0])) {
       move_set_score(&move, 19000);
     } else if (are_moves_equal(move,
-                               search_info->killer_moves[board->ply][1])) {
+                               search_info->stack[board->ply].killer_moves[1])) {
       move_set_score(&move, 18990);
     } else if (move_move_type(move) == PROMOTION &&
                move_flag(move) == QUEEN_PROMOTION) {
@@ -2545,18 +2891,26 @@ int quiescence_search(board_t *board, search_info_t *search_info, int alpha,
     alpha = best_score;
   }
 
-  move_list_t *move_list = move_list_new();
+  if (board->ply >= MAX_PLY) {
+    return best_score;
+  }
+
+  move_list_t *move_list = &search_info->stack[board->ply].move_list;
+  move_list_reset(move_list);
   generate_all_captures(board, move_list);
   score_moves(board, search_info, move_list, 0ULL);
 
   for (size_t i = 0; i < move_list->count; i++) {
     order_moves(move_list, i);
 
-    if (!make_move(board, move_list->moves[i])) {
-      unmake_move(board, move_list->moves[i]);
+    // a capture that loses material in the exchange is very unlikely to
+    // raise alpha when standing pat already didn't
+    if (is_losing_capture(board, move_list->moves[i])) {
       continue;
     }
 
+    make_move(board, move_list->moves[i]);
+
     int score = -quiescence_search(board, search_info, -beta, -alpha);
 
     unmake_move(board, move_list->moves[i]);
@@ -2566,7 +2920,6 @@ int quiescence_search(board_t *board, search_info_t *search_info, int alpha,
     }
 
     if (score >= beta) {
-      free(move_list);
       return beta;
     }
 
@@ -2575,27 +2928,340 @@ int quiescence_search(board_t *board, search_info_t *search_info, int alpha,
     }
   }
 
-  free(move_list);
-  return best_score;
+  return best_score;
+}
+
+void store_killer_move(const board_t *board, search_info_t *search_info,
+                       int ply, move_t move) {
+  if (board->pieces[move_to(move)] == EMPTY) {
+    move_t *killer_moves = search_info->stack[ply].killer_moves;
+
+    if (!are_moves_equal(move, killer_moves[0])) {
+      killer_moves[1] = killer_moves[0];
+      killer_moves[0] = move;
+    }
+  }
+}
+
+#define HISTORY_MAX 8192
+
+// gravity update: the closer an entry is to the limit the less a bonus moves
+// it, so scores stay within +-HISTORY_MAX and recent cutoffs can outweigh old
+// ones
+void history_update(int *entry, int bonus) {
+  int magnitude = bonus < 0 ? -bonus : bonus;
+  *entry += bonus - *entry * magnitude / HISTORY_MAX;
+}
+
+// the previous move is null at the root and after a null move
+move_t get_countermove(const board_t *board, const search_info_t *search_info) {
+  if (board->ply == 0) {
+    return 0;
+  }
+
+  move_t previous = search_info->stack[board->ply - 1].current_move;
+
+  if (previous == 0) {
+    return 0;
+  }
+
+  int square = move_to(previous);
+  return search_info->countermoves[board->pieces[square]][square];
+}
+
+// rewards the quiet move that cut off and penalises the quiets searched before
+// it, which didn't
+void update_quiet_history(const board_t *board, search_info_t *search_info,
+                          move_t move, int depth, const move_t *quiets_searched,
+                          int quiet_count) {
+  int (*history)[64] = search_info->history[board->side];
+  int bonus = depth * depth;
+
+  history_update(&history[move_from(move)][move_to(move)], bonus);
+
+  for (int i = 0; i < quiet_count; i++) {
+    move_t quiet = quiets_searched[i];
+    history_update(&history[move_from(quiet)][move_to(quiet)], -bonus);
+  }
+
+  if (board->ply > 0) {
+    move_t previous = search_info->stack[board->ply - 1].current_move;
+
+    if (previous != 0) {
+      int square = move_to(previous);
+      search_info->countermoves[board->pieces[square]][square] = move;
+    }
+  }
+}
+
+// quiets are ordered by history, after the countermove to the previous move.
+// both land in 0..2 * HISTORY_MAX + 1, inside the 15 bits a move score can
+// safely use
+void score_quiet_moves(const board_t *board, const search_info_t *search_info,
+                       move_list_t *move_list, size_t start,
+                       move_t countermove) {
+  const int(*history)[64] = search_info->history[board->side];
+
+  for (size_t i = start; i < move_list->count; i++) {
+    move_t move = move_list->moves[i];
+
+    if (countermove != 0 && are_moves_equal(move, countermove)) {
+      move_set_score(&move, 2 * HISTORY_MAX + 1);
+    } else {
+      move_set_score(&move,
+                     history[move_from(move)][move_to(move)] + HISTORY_MAX);
+    }
+
+    move_list->moves[i] = move;
+  }
+}
+
+typedef enum {
+  PICK_TT_MOVE,
+  PICK_GENERATE_CAPTURES,
+  PICK_CAPTURES,
+  PICK_KILLERS,
+  PICK_GENERATE_QUIETS,
+  PICK_QUIETS,
+  PICK_BAD_CAPTURES,
+  PICK_DONE
+} pick_stage_t;
+
+// hands out moves one at a time, generating each stage only when the previous
+// one is used up. most cut nodes fail high on the tt move or a capture and
+// never generate quiets at all
+typedef struct {
+  pick_stage_t stage;
+  legality_t *legality;
+  move_list_t *move_list;
+  size_t index;
+  // captures that lose material are moved to the front of the list as they
+  // come up and searched after the quiets
+  size_t bad_capture_count;
+  move_t tt_move;
+  move_t killers[2];
+  int killer_index;
+  move_t countermove;
+} move_picker_t;
+
+// `legality` has the node's checks already, the picker adds the pins
+void move_picker_init(move_picker_t *picker, const board_t *board,
+                      search_info_t *search_info, legality_t *legality,
+                      move_t tt_move) {
+  legality_find_pins(legality, board);
+
+  picker->stage = PICK_TT_MOVE;
+  picker->legality = legality;
+  picker->move_list = &search_info->stack[board->ply].move_list;
+  picker->index = 0;
+  picker->bad_capture_count = 0;
+  picker->tt_move = tt_move;
+  picker->killers[0] = search_info->stack[board->ply].killer_moves[0];
+  picker->killers[1] = search_info->stack[board->ply].killer_moves[1];
+  picker->killer_index = 0;
+  picker->countermove = get_countermove(board, search_info);
+}
+
+// the capture stage also hands out queen promotions and en passant, so a
+// killer only gets its own stage if it's none of those
+bool is_quiet_move(const board_t *board, move_t move) {
+  return board->pieces[move_to(move)] == EMPTY &&
+         !(move_move_type(move) == CAPTURE &&
+           move_flag(move) == EN_PASSANT_FLAG) &&
+         !(move_move_type(move) == PROMOTION &&
+           move_flag(move) == QUEEN_PROMOTION);
+}
+
+bool move_picker_is_duplicate(const move_picker_t *picker, move_t move) {
+  if (are_moves_equal(move, picker->tt_move)) {
+    return true;
+  }
+
+  for (int i = 0; i < picker->killer_index; i++) {
+    if (are_moves_equal(move, picker->killers[i])) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// returns the next move to search, or 0 once every legal move has been handed
+// out
+move_t move_picker_next(move_picker_t *picker, board_t *board,
+                        search_info_t *search_info) {
+  move_list_t *move_list = picker->move_list;
+
+  switch (picker->stage) {
+  case PICK_TT_MOVE:
+    picker->stage = PICK_GENERATE_CAPTURES;
+
+    if (picker->tt_move != 0 &&
+        is_move_legal(board, picker->legality, picker->tt_move)) {
+      return picker->tt_move;
+    }
+
+    // the tt move might be from another position with the same key bits
+    picker->tt_move = 0;
+    // fall through
+  case PICK_GENERATE_CAPTURES:
+    move_list_reset(move_list);
+    generate_moves(board, move_list, picker->legality, CAPTURE_MOVES);
+    score_moves(board, search_info, move_list, 0ULL);
+    picker->index = 0;
+    picker->stage = PICK_CAPTURES;
+    // fall through
+  case PICK_CAPTURES:
+    while (picker->index < move_list->count) {
+      order_moves(move_list, picker->index);
+      move_t move = move_list->moves[picker->index++];
+
+      if (are_moves_equal(move, picker->tt_move)) {
+        continue;
+      }
+
+      if (is_losing_capture(board, move)) {
+        move_list->moves[picker->bad_capture_count++] = move;
+        continue;
+      }
+
+      return move;
+    }
+
+    picker->stage = PICK_KILLERS;
+    // fall through
+  case PICK_KILLERS:
+    while (picker->killer_index < 2) {
+      move_t killer = picker->killers[picker->killer_index];
+
+      if (killer == 0 || are_moves_equal(killer, picker->tt_move) ||
+          (picker->killer_index == 1 &&
+           are_moves_equal(killer, picker->killers[0])) ||
+          !is_quiet_move(board, killer) ||
+          !is_move_legal(board, picker->legality, killer)) {
+        // drop it so the quiet stage doesn't skip it as already searched
+        picker->killers[picker->killer_index] = 0;
+        picker->killer_index++;
+        continue;
+      }
+
+      picker->killer_index++;
+      return killer;
+    }
+
+    picker->stage = PICK_GENERATE_QUIETS;
+    // fall through
+  case PICK_GENERATE_QUIETS:
+    // quiets go in after the bad captures being held back
+    move_list->count = picker->bad_capture_count;
+    generate_moves(board, move_list, picker->legality, QUIET_MOVES);
+    score_quiet_moves(board, search_info, move_list, picker->bad_capture_count,
+                      picker->countermove);
+    picker->index = picker->bad_capture_count;
+    picker->stage = PICK_QUIETS;
+    // fall through
+  case PICK_QUIETS:
+    while (picker->index < move_list->count) {
+      order_moves(move_list, picker->index);
+      move_t move = move_list->moves[picker->index++];
+
+      if (!move_picker_is_duplicate(picker, move)) {
+        return move;
+      }
+    }
+
+    picker->index = 0;
+    picker->stage = PICK_BAD_CAPTURES;
+    // fall through
+  case PICK_BAD_CAPTURES:
+    // already in the order they were picked
+    if (picker->index < picker->bad_capture_count) {
+      return move_list->moves[picker->index++];
+    }
+
+    picker->stage = PICK_DONE;
+    // fall through
+  case PICK_DONE:
+    return 0;
+  }
+
+  return 0;
+}
+
+// every history item holds the hash of the position before its move, so the
+// position `i` plies ago is items[length - i]. a position can only
+// repeat with the same side to move and since the last capture or pawn move,
+// so the scan steps back two plies at a time no further than the halfmove
+// clock. the position two plies back can't be the same, one piece per side has
+// moved since
+bool is_repetition(const board_t *board) {
+  const history_t *history = board->history;
+  int limit = board->repetition_clock < history->length
+                  ? board->repetition_clock
+                  : history->length;
+
+  for (int i = 4; i <= limit; i += 2) {
+    if (history->items[history->length - i].hash == board->hash) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#define NULL_MOVE_MIN_DEPTH 3
+#define NULL_MOVE_VERIFY_DEPTH 10
+
+#define LMR_MIN_DEPTH 3
+#define LMR_MIN_MOVES 3
+
+// null move pruning relies on moving being better than passing, which isn't
+// true in zugzwang. that's mostly pawn endgames, so those never try it
+bool has_non_pawn_material(const board_t *board, side_t side) {
+  return (board->bitboards[side_piece(side, WHITE_KNIGHT)] |
+          board->bitboards[side_piece(side, WHITE_BISHOP)] |
+          board->bitboards[side_piece(side, WHITE_ROOK)] |
+          board->bitboards[side_piece(side, WHITE_QUEEN)]) != 0;
 }
 
-void store_killer_move(const board_t *board, search_info_t *search_info,
-                       int ply, move_t move) {
-  if (board->pieces[move_to(move)] == EMPTY) {
-    if (!are_moves_equal(move, search_info->killer_moves[ply][0])) {
-      search_info->killer_moves[ply][1] = search_info->killer_moves[ply][0];
-      search_info->killer_moves[ply][0] = move;
-    }
+// the checks in the current position, reusing the ones in this ply's stack
+// frame if they were already found for it
+legality_t *get_node_legality(const board_t *board,
+                              search_info_t *search_info) {
+  search_stack_t *frame = &search_info->stack[board->ply];
+
+  if (frame->legality_hash != board->hash) {
+    legality_find_checks(&frame->legality, board);
+    frame->legality_hash = board->hash;
   }
+
+  return &frame->legality;
 }
 
 int negamax(board_t *board, transposition_table_t *tt, int depth, int alpha,
             int beta, move_t *best_move, search_info_t *search_info) {
-  if (is_in_check(board, board->side)) {
+  // a repeated position is scored as a draw on its first repetition, since
+  // whoever could avoid a threefold would have done so the first time round.
+  // never at the root, which has to return a move
+  if (board->ply > 0 &&
+      (board->halfmove_clock >= 100 || is_repetition(board))) {
+    return 0;
+  }
+
+  // checked before anything touches this ply's stack frame, which doesn't
+  // exist at MAX_PLY
+  if (board->ply >= MAX_PLY) {
+    return evaluate_position(board);
+  }
+
+  legality_t *legality = get_node_legality(board, search_info);
+  bool in_check = legality->checkers != 0;
+
+  if (in_check) {
     depth++;
   }
 
-  if (depth == 0) {
+  if (depth <= 0) {
     return quiescence_search(board, search_info, alpha, beta);
   }
 
@@ -2613,51 +3279,173 @@ int negamax(board_t *board, transposition_table_t *tt, int depth, int alpha,
   move_t pv_move = 0ULL;
   int best_score = -INFINITY;
 
-  transposition_table_entry_t *tt_entry =
-      transposition_table_probe(tt, board->hash);
+  transposition_table_entry_t tt_entry;
+  bool tt_hit = transposition_table_probe(tt, board->hash, &tt_entry);
 
-  if (transposition_table_entry_get(tt_entry, board->hash, depth, board->ply,
-                                    alpha, beta, &pv_move, &best_score)) {
+  // never cut off at the root, the caller needs a best move back
+  if (transposition_table_entry_get(tt_hit ? &tt_entry : NULL, depth,
+                                    board->ply, alpha, beta, &pv_move,
+                                    &best_score) &&
+      board->ply > 0) {
     return best_score;
   }
 
-  int old_alpha = alpha;
+  // if passing the turn still fails high at reduced depth, a real move almost
+  // certainly would too. not in check, where passing is illegal, and not
+  // right after another null move
+  if (board->ply > 0 && !in_check && depth >= NULL_MOVE_MIN_DEPTH &&
+      board->ply >= search_info->null_move_min_ply &&
+      search_info->stack[board->ply - 1].current_move != 0 &&
+      abs(beta) < CHECKMATE && has_non_pawn_material(board, board->side) &&
+      evaluate_position(board) >= beta) {
+    int reduction = 3 + depth / 6;
+
+    make_null_move(board);
+    search_info->stack[board->ply - 1].current_move = 0;
+
+    int score = -negamax(board, tt, depth - 1 - reduction, -beta, -beta + 1,
+                         best_move, search_info);
+
+    unmake_null_move(board);
+
+    if (search_info->stopped) {
+      return 0;
+    }
+
+    if (score >= beta) {
+      if (depth < NULL_MOVE_VERIFY_DEPTH) {
+        return beta;
+      }
+
+      // deep cutoffs are confirmed by a reduced search without null moves
+      // for the next few plies, which catches zugzwang the material check
+      // above lets through. the old limit is put back afterwards, this may be
+      // nested inside another verification that isn't finished yet
+      int saved_null_move_min_ply = search_info->null_move_min_ply;
+      search_info->null_move_min_ply =
+          board->ply + 3 * (depth - 1 - reduction) / 4;
+
+      score = negamax(board, tt, depth - 1 - reduction, beta - 1, beta,
+                      best_move, search_info);
+
+      search_info->null_move_min_ply = saved_null_move_min_ply;
+
+      if (score >= beta) {
+        return beta;
+      }
+    }
+  }
 
-  move_list_t *move_list = move_list_new();
-  generate_all_moves(board, move_list);
+  best_score = -INFINITY;
+  move_t node_best_move = 0;
+  int old_alpha = alpha;
 
-  score_moves(board, search_info, move_list, pv_move);
+  move_picker_t picker;
+  move_picker_init(&picker, board, search_info, legality, pv_move);
 
   size_t legal_move_count = 0;
+  move_t move;
 
-  for (size_t i = 0; i < move_list->count; i++) {
-    order_moves(move_list, i);
+  // quiets that didn't cut off, to be penalised if a later one does
+  move_t quiets_searched[64];
+  int quiet_count = 0;
 
-    if (!make_move(board, move_list->moves[i])) {
-      unmake_move(board, move_list->moves[i]);
-      continue;
+  while ((move = move_picker_next(&picker, board, search_info)) != 0) {
+    // the picker puts capturing under-promotions among the quiets, so the
+    // stage alone doesn't say whether a move is quiet
+    bool quiet = is_quiet_move(board, move);
+
+    make_move(board, move);
+
+    search_info->stack[board->ply - 1].current_move = move;
+
+    int score;
+
+    // principal variation search: once the first move has set alpha, the rest
+    // only need to prove they can't beat it, which a null window does cheaply.
+    // one that does beat it gets searched again with the full window
+    if (legal_move_count == 0) {
+      score =
+          -negamax(board, tt, depth - 1, -beta, -alpha, best_move, search_info);
+    } else {
+      int reduction = 0;
+
+      // late move reductions: quiets that come after the tt move, captures
+      // and killers are searched shallower first. checks and evasions aren't
+      // reduced, they're too often the one move that matters
+      if (depth >= LMR_MIN_DEPTH && legal_move_count >= LMR_MIN_MOVES &&
+          picker.stage == PICK_QUIETS && quiet && !in_check &&
+          board->ply < MAX_PLY &&
+          get_node_legality(board, search_info)->checkers == 0) {
+        int table_depth =
+            depth < MAX_SEARCH_DEPTH ? depth : MAX_SEARCH_DEPTH - 1;
+        reduction = LATE_MOVE_REDUCTIONS[table_depth][legal_move_count];
+
+        // always leave at least one ply of full width search
+        if (reduction > depth - 2) {
+          reduction = depth - 2;
+        }
+      }
+
+      score = -negamax(board, tt, depth - 1 - reduction, -alpha - 1, -alpha,
+                       best_move, search_info);
+
+      // a reduced move that beats alpha gets its full depth back
+      if (reduction > 0 && score > alpha) {
+        score = -negamax(board, tt, depth - 1, -alpha - 1, -alpha, best_move,
+                         search_info);
+      }
+
+      if (score > alpha && score < beta) {
+        score = -negamax(board, tt, depth - 1, -beta, -alpha, best_move,
+                         search_info);
+      }
     }
 
-    int score =
-        -negamax(board, tt, depth - 1, -beta, -alpha, best_move, search_info);
-    unmake_move(board, move_list->moves[i]);
+    unmake_move(board, move);
+
+    // a stopped child's score means nothing. none of it may reach the table,
+    // which outlives this search, or the killers and history
+    if (search_info->stopped) {
+      return 0;
+    }
 
     if (score >= beta) {
-      transposition_table_store(tt, board->hash, 0, depth, board->ply,
-                                best_score, *best_move, TT_BETA_FLAG);
+      search_info->beta_cutoffs++;
+      if (legal_move_count == 0) {
+        search_info->first_move_cutoffs++;
+      }
+
+      transposition_table_store(tt, board->hash, depth, board->ply, beta,
+                                move, TT_BETA_FLAG);
+
+      if (quiet) {
+        store_killer_move(board, search_info, board->ply, move);
+        update_quiet_history(board, search_info, move, depth, quiets_searched,
+                             quiet_count);
+      }
+
+      // an aspiration window can fail high at the root, the move is still the
+      // best one found
+      if (board->ply == 0) {
+        *best_move = move;
+      }
 
-      store_killer_move(board, search_info, board->ply, move_list->moves[i]);
-      free(move_list);
       return beta;
     }
 
+    if (quiet_count < 64 && quiet) {
+      quiets_searched[quiet_count++] = move;
+    }
+
     if (score > best_score) {
       best_score = score;
+      node_best_move = move;
 
       if (score > alpha) {
         alpha = score;
         if (board->ply == 0) {
-          *best_move = move_list->moves[i];
+          *best_move = move;
         }
       }
     }
@@ -2667,18 +3455,21 @@ int negamax(board_t *board, transposition_table_t *tt, int depth, int alpha,
 
   // checkmate or stalemate
   if (legal_move_count == 0) {
-    if (is_in_check(board, board->side)) {
+    if (in_check) {
       return -INFINITY + board->ply;
     } else {
       return 0;
     }
   }
 
-  transposition_table_store(tt, board->hash, 0, depth, board->ply, best_score,
-                            *best_move,
+  if (search_info->stopped) {
+    return 0;
+  }
+
+  transposition_table_store(tt, board->hash, depth, board->ply, best_score,
+                            node_best_move,
                             old_alpha != alpha ? TT_EXACT_FLAG : TT_ALPHA_FLAG);
 
-  free(move_list);
   return best_score;
 }
 
@@ -2700,18 +3491,112 @@ char *uci_get_score(int score) {
   return score_string;
 }
 
-void search_position(board_t *board, search_info_t *search_info,
-                     transposition_table_t *tt) {
+typedef struct {
+  pthread_t thread;
+  int id;
+  board_t board;
+  search_info_t search_info;
+  transposition_table_t *tt;
+} search_thread_t;
+
+#define ASPIRATION_WINDOW 35
+#define ASPIRATION_MIN_DEPTH 4
+
+// searches the root in a narrow window around the previous iteration's score,
+// widening the side that failed until the score lands inside it. mate scores
+// jump around too much between iterations to be worth guessing
+int aspiration_search(board_t *board, transposition_table_t *tt, int depth,
+                      int previous_score, move_t *best_move,
+                      search_info_t *search_info) {
+  int delta = ASPIRATION_WINDOW;
+  int alpha = -INFINITY;
+  int beta = INFINITY;
+
+  if (depth >= ASPIRATION_MIN_DEPTH && abs(previous_score) < CHECKMATE) {
+    alpha = previous_score - delta;
+    beta = previous_score + delta;
+  }
+
+  while (1) {
+    int score = negamax(board, tt, depth, alpha, beta, best_move, search_info);
+
+    if (search_info->stopped) {
+      return score;
+    }
+
+    if (score <= alpha && alpha > -INFINITY) {
+      alpha = alpha - delta > -INFINITY ? alpha - delta : -INFINITY;
+    } else if (score >= beta && beta < INFINITY) {
+      beta = beta + delta < INFINITY ? beta + delta : INFINITY;
+    } else {
+      return score;
+    }
+
+    delta *= 2;
+  }
+}
+
+// lazy SMP helper: searches the same root position as the main thread with its
+// own board and killers, sharing only the transposition table. its results are
+// never reported, the point is to fill the table with entries the main thread
+// can use
+void *helper_search(void *arg) {
+  search_thread_t *helper = arg;
+  board_t *board = &helper->board;
+  search_info_t *search_info = &helper->search_info;
+
+  board->ply = 0;
+
+  move_t best_move = 0;
+  int score = 0;
+
+  // odd helpers start a ply deeper so the threads don't all search the same
+  // depth in lockstep
+  for (int depth = 1 + (helper->id & 1); depth <= search_info->depth;
+       depth++) {
+    score = aspiration_search(board, helper->tt, depth, score, &best_move,
+                              search_info);
+
+    if (search_info->stopped) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+move_t search_position(board_t *board, search_info_t *search_info,
+                       transposition_table_t *tt, int thread_count) {
   board->ply = 0;
 
+  transposition_table_new_search(tt);
+
+  int helper_count = thread_count - 1;
+  search_thread_t *helpers = malloc(helper_count * sizeof(search_thread_t));
+
+  for (int i = 0; i < helper_count; i++) {
+    helpers[i].id = i + 1;
+    helpers[i].board = *board;
+    helpers[i].board.history = history_clone(board->history);
+    helpers[i].search_info = *search_info;
+    helpers[i].tt = tt;
+
+    // helpers keep going until the main thread tells them to stop
+    helpers[i].search_info.time_left = INFINITE_SEARCH_TIME;
+    helpers[i].search_info.move_time = INFINITE_SEARCH_TIME;
+
+    pthread_create(&helpers[i].thread, NULL, helper_search, &helpers[i]);
+  }
+
   move_t best_move = 0;
   uint64_t total_time = 0ULL;
+  int score = 0;
 
   for (int depth = 1; depth <= search_info->depth; depth++) {
-    move_t current_best_move;
+    move_t current_best_move = best_move;
     int start_time = get_time_ms();
-    int score = negamax(board, tt, depth, -INFINITY, INFINITY,
-                        &current_best_move, search_info);
+    score = aspiration_search(board, tt, depth, score, &current_best_move,
+                              search_info);
     int end_time = get_time_ms() - start_time;
 
     if (search_info->stopped) {
@@ -2725,16 +3610,65 @@ void search_position(board_t *board, search_info_t *search_info,
 
     total_time += end_time;
 
-    printf("info depth %d score %s nodes %lu time %lu\n", depth,
-           uci_get_score(score), search_info->nodes_searched, total_time);
+    uint64_t nodes = search_info->nodes_searched;
+    for (int i = 0; i < helper_count; i++) {
+      nodes += helpers[i].search_info.nodes_searched;
+    }
+
+    if (!search_info->silent) {
+      uint64_t nps = total_time > 0 ? nodes * 1000 / total_time : 0;
+
+      printf("info depth %d score %s nodes %lu nps %lu time %lu hashfull %d\n",
+             depth, uci_get_score(score), nodes, nps, total_time,
+             transposition_table_hashfull(tt));
+    }
+  }
+
+  // stopped before the first iteration got through a single root move, any
+  // legal move beats sending none
+  if (best_move == 0) {
+    move_list_t root_moves;
+    move_list_reset(&root_moves);
+    generate_all_moves(board, &root_moves);
+
+    if (root_moves.count > 0) {
+      best_move = root_moves.moves[0];
+    }
   }
 
-  printf("bestmove %s%s", SQUARE_TO_READABLE[move_from(best_move)],
-         SQUARE_TO_READABLE[move_to(best_move)]);
-  if (move_move_type(best_move) == PROMOTION) {
-    printf("%c", FLAG_TO_ALGEBRAIC_NOTATION[move_flag(best_move)]);
+  // in infinite mode the GUI only expects a bestmove after it sends `stop`
+  struct timespec poll_interval = {.tv_sec = 0, .tv_nsec = 1000000};
+  while (search_info->infinite && !search_info->stopped) {
+    nanosleep(&poll_interval, NULL);
   }
-  printf("\n");
+
+  for (int i = 0; i < helper_count; i++) {
+    helpers[i].search_info.stopped = true;
+  }
+
+  for (int i = 0; i < helper_count; i++) {
+    pthread_join(helpers[i].thread, NULL);
+  }
+
+  // report the whole search's nodes back to the caller, not just this thread's
+  for (int i = 0; i < helper_count; i++) {
+    search_info->nodes_searched += helpers[i].search_info.nodes_searched;
+    history_free(helpers[i].board.history);
+  }
+
+  free(helpers);
+
+  // the UCI thread may answer `isready` while this runs, so hold the stream
+  // to keep `readyok` from landing in the middle of the line
+  if (!search_info->silent) {
+    flockfile(stdout);
+    printf("bestmove ");
+    move_print_uci(best_move);
+    printf("\n");
+    funlockfile(stdout);
+  }
+
+  return best_move;
 }
 
 move_t uci_parse_move(board_t *board, char *move_string) {
@@ -2765,11 +3699,12 @@ move_t uci_parse_move(board_t *board, char *move_string) {
   int from = (move_string[0] - 'a') + (move_string[1] - '1') * 8;
   int to = (move_string[2] - 'a') + (move_string[3] - '1') * 8;
 
-  move_list_t *move_list = move_list_new();
-  generate_all_moves(board, move_list);
+  move_list_t move_list;
+  move_list_reset(&move_list);
+  generate_all_moves(board, &move_list);
 
-  for (size_t i = 0; i < move_list->count; i++) {
-    move_t move = move_list->moves[i];
+  for (size_t i = 0; i < move_list.count; i++) {
+    move_t move = move_list.moves[i];
 
     if (move_from(move) == from && move_to(move) == to) {
       if (move_move_type(move) == PROMOTION) {
@@ -2846,8 +3781,8 @@ void uci_parse_position(board_t *board, char *position) {
       }
     }
 
-    // the moves won't be undone, so no point storing them in history
-    board->history_length = 0;
+    // the moves stay in history so the search can see repetitions of
+    // positions from earlier in the game
   }
 }
 
@@ -2873,21 +3808,62 @@ search_info_t search_info_new() {
   search_info.moves_to_go = -1;
   search_info.move_time = INFINITE_SEARCH_TIME;
   search_info.depth = MAX_SEARCH_DEPTH;
+  search_info.infinite = false;
 
   // calculated search info
   search_info.stopped = false;
   search_info.stop_time = -1;
   search_info.nodes_searched = 0ULL;
-
-  for (int ply = 0; ply < MAX_SEARCH_DEPTH + 1; ply++) {
-    search_info.killer_moves[ply][0] = 0ULL;
-    search_info.killer_moves[ply][1] = 0ULL;
+  search_info.null_move_min_ply = 0;
+  search_info.beta_cutoffs = 0;
+  search_info.first_move_cutoffs = 0;
+
+  memset(search_info.history, 0, sizeof(search_info.history));
+  memset(search_info.countermoves, 0, sizeof(search_info.countermoves));
+
+  for (int ply = 0; ply < MAX_PLY; ply++) {
+    search_info.stack[ply].killer_moves[0] = 0ULL;
+    search_info.stack[ply].killer_moves[1] = 0ULL;
+    search_info.stack[ply].current_move = 0ULL;
+    search_info.stack[ply].legality_hash = 0ULL;
   }
 
+  search_info.silent = false;
+
   return search_info;
 }
 
-void uci_parse_go(board_t *board, char *move_string) {
+// state of the search running in the background while the UCI loop keeps
+// reading commands
+typedef struct {
+  pthread_t thread;
+  bool running;
+  board_t *board;
+  search_info_t search_info;
+  transposition_table_t *tt;
+  int thread_count;
+} uci_search_t;
+
+void *uci_search_thread(void *arg) {
+  uci_search_t *search = arg;
+  search_position(search->board, &search->search_info, search->tt,
+                  search->thread_count);
+  return NULL;
+}
+
+void uci_stop_search(uci_search_t *search) {
+  if (!search->running) {
+    return;
+  }
+
+  search->search_info.stopped = true;
+  pthread_join(search->thread, NULL);
+  search->running = false;
+}
+
+void uci_parse_go(board_t *board, char *move_string, uci_search_t *search) {
+  uci_stop_search(search);
+
   search_info_t search_info = search_info_new();
   char *current = NULL;
 
@@ -2909,14 +3885,297 @@ void uci_parse_go(board_t *board, char *move_string) {
   }
 
   current = strstr(move_string, "movetime");
-  if (current && board->side == BLACK) {
+  if (current) {
     search_info.move_time = atoi(current + 9);
   }
 
-  transposition_table_t *tt = transposition_table_new(64);
+  current = strstr(move_string, "infinite");
+  if (current) {
+    search_info.infinite = true;
+  }
 
   start_search_timer(&search_info);
-  search_position(board, &search_info, tt);
+
+  search->board = board;
+  search->search_info = search_info;
+  search->running = true;
+  pthread_create(&search->thread, NULL, uci_search_thread, search);
+}
+
+void uci_parse_setoption(char *input, uci_search_t *search) {
+  char *name = strstr(input, "name");
+  char *value = strstr(input, "value");
+
+  if (name == NULL || value == NULL) {
+    return;
+  }
+
+  name += 5;
+  value += 6;
+
+  if (strncmp(name, "Threads", 7) == 0) {
+    int threads = atoi(value);
+
+    if (threads < 1) {
+      threads = 1;
+    }
+
+    if (threads > MAX_SEARCH_THREADS) {
+      threads = MAX_SEARCH_THREADS;
+    }
+
+    search->thread_count = threads;
+  } else if (strncmp(name, "Hash", 4) == 0) {
+    int size_in_mb = atoi(value);
+
+    if (size_in_mb < 1) {
+      size_in_mb = 1;
+    }
+
+    if (size_in_mb > MAX_HASH_MB) {
+      size_in_mb = MAX_HASH_MB;
+    }
+
+    transposition_table_resize(search->tt, size_in_mb, search->thread_count);
+  }
+}
+
+const char *BENCH_FENS[] = {
+    START_FEN,
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r1bq1rk1/ppp2pbp/2np1np1/4p3/2B1P3/2NP1N2/PPP2PPP/R1BQ1RK1 w - - 0 11",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+    "8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1",
+};
+
+#define BENCH_FEN_COUNT (sizeof(BENCH_FENS) / sizeof(BENCH_FENS[0]))
+
+// time-to-depth over the bench positions for a growing number of threads.
+// every run gets a fresh transposition table so earlier runs can't help later
+// ones
+void bench_smp_scaling(int depth) {
+  const int thread_counts[] = {1, 2, 4, 8, 16};
+  int base_time = 0;
+
+  board_t *board = board_new();
+
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+       i++) {
+    int total_time = 0;
+
+    for (size_t j = 0; j < BENCH_FEN_COUNT; j++) {
+      board_reset(board);
+      board_parse_FEN(board, (char *)BENCH_FENS[j]);
+
+      transposition_table_t *tt = transposition_table_new(64);
+      search_info_t search_info = search_info_new();
+      search_info.depth = depth;
+      search_info.silent = true;
+
+      int start = get_time_ms();
+      start_search_timer(&search_info);
+      search_position(board, &search_info, tt, thread_counts[i]);
+      total_time += get_time_ms() - start;
+
+      transposition_table_free(tt);
+    }
+
+    if (i == 0) {
+      base_time = total_time;
+    }
+
+    printf("threads %2d: depth %d in %6d ms, speedup %.2fx\n",
+           thread_counts[i], depth, total_time,
+           total_time > 0 ? (float)base_time / total_time : 0.0f);
+  }
+
+  board_free(board);
+}
+
+#define DEFAULT_BENCH_DEPTH 12
+#define DEFAULT_BENCH_HASH_MB 16
+
+// fixed depth search over the bench positions, each from a cleared table. the
+// total node count is a signature of the search: with one thread it only
+// changes when search behaviour does, while nps tracks speed on its own
+void bench(int depth, int hash_mb, int thread_count, bool json) {
+  board_t *board = board_new();
+  transposition_table_t *tt = transposition_table_new(hash_mb);
+
+  uint64_t total_nodes = 0;
+  uint64_t beta_cutoffs = 0;
+  uint64_t first_move_cutoffs = 0;
+  int total_time = 0;
+
+  for (size_t i = 0; i < BENCH_FEN_COUNT; i++) {
+    board_reset(board);
+    board_parse_FEN(board, (char *)BENCH_FENS[i]);
+    transposition_table_clear(tt, thread_count);
+
+    search_info_t search_info = search_info_new();
+    search_info.depth = depth;
+    search_info.silent = true;
+
+    int start = get_time_ms();
+    start_search_timer(&search_info);
+    search_position(board, &search_info, tt, thread_count);
+    int time = get_time_ms() - start;
+
+    total_nodes += search_info.nodes_searched;
+    total_time += time;
+
+    // only the main thread's, helpers keep their own counts
+    beta_cutoffs += search_info.beta_cutoffs;
+    first_move_cutoffs += search_info.first_move_cutoffs;
+
+    if (!json) {
+      printf("position %2zu/%zu: %10lu nodes %6d ms\n", i + 1,
+             BENCH_FEN_COUNT, search_info.nodes_searched, time);
+    }
+  }
+
+  uint64_t nps = total_nodes * 1000 / (total_time ? total_time : 1);
+  double first_move_cutoff_rate =
+      beta_cutoffs > 0 ? 100.0 * first_move_cutoffs / beta_cutoffs : 0.0;
+
+  if (json) {
+    printf("{\"depth\": %d, \"hash\": %d, \"threads\": %d, "
+           "\"positions\": %zu, \"nodes\": %lu, \"time_ms\": %d, "
+           "\"nps\": %lu, \"first_move_cutoffs\": %.1f}\n",
+           depth, hash_mb, thread_count, BENCH_FEN_COUNT, total_nodes,
+           total_time, nps, first_move_cutoff_rate);
+  } else {
+    printf("\nTotal time (ms) : %d\n", total_time);
+    printf("Nodes searched  : %lu\n", total_nodes);
+    printf("Nodes/second    : %lu\n", nps);
+    printf("First move cuts : %.1f%%\n", first_move_cutoff_rate);
+  }
+
+  transposition_table_free(tt);
+  board_free(board);
+}
+
+// `bench [depth] [hash] [threads] [json]`, missing or invalid numbers fall
+// back to the defaults
+void parse_bench(char *input) {
+  int depth = DEFAULT_BENCH_DEPTH;
+  int hash_mb = DEFAULT_BENCH_HASH_MB;
+  int thread_count = 1;
+  bool json = strstr(input, "json") != NULL;
+
+  int values[3] = {0, 0, 0};
+  sscanf(input, "bench %d %d %d", &values[0], &values[1], &values[2]);
+
+  if (values[0] > 0 && values[0] <= MAX_SEARCH_DEPTH) {
+    depth = values[0];
+  }
+
+  if (values[1] > 0 && values[1] <= MAX_HASH_MB) {
+    hash_mb = values[1];
+  }
+
+  if (values[2] > 0 && values[2] <= MAX_SEARCH_THREADS) {
+    thread_count = values[2];
+  }
+
+  bench(depth, hash_mb, thread_count, json);
+}
+
+#ifdef USE_PEXT
+#define SLIDER_BACKEND "pext"
+#else
+#define SLIDER_BACKEND "magic"
+#endif
+
+// slider attack lookups per second for whichever backend this build uses
+void bench_attack_lookups() {
+  const int occupancy_count = 4096;
+  const int rounds = 512;
+
+  uint64_t *occupancies = malloc(occupancy_count * sizeof(uint64_t));
+  prng_t prng = prng_new(42);
+
+  // sparse random boards look more like real positions than uniform noise
+  for (int i = 0; i < occupancy_count; i++) {
+    occupancies[i] = prng_generate_random(&prng) &
+                     prng_generate_random(&prng) &
+                     prng_generate_random(&prng);
+  }
+
+  uint64_t checksum = 0ULL;
+  uint64_t lookups = 0ULL;
+
+  int start = get_time_ms();
+
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < occupancy_count; i++) {
+      // vary the boards between rounds so no lookup can be hoisted out
+      uint64_t occupancy = occupancies[i] ^ (uint64_t)round;
+
+      for (int square = 0; square < 64; square++) {
+        checksum += get_rook_attacks(square, occupancy);
+        checksum += get_bishop_attacks(square, occupancy);
+      }
+    }
+  }
+
+  lookups = 2ULL * rounds * occupancy_count * 64;
+
+  int elapsed = get_time_ms() - start;
+  uint64_t lookups_per_second =
+      elapsed > 0 ? lookups * 1000 / elapsed : lookups * 1000;
+
+  printf("backend %s: %lu lookups in %d ms, %lu lookups/s (checksum %lx)\n",
+         SLIDER_BACKEND, lookups, elapsed, lookups_per_second, checksum);
+
+  // the same lookups with reads from a hash table sized buffer mixed in, the
+  // way transposition table probes push the slider tables out of cache in a
+  // real search
+  const size_t pressure_count = 64 * 1024 * 1024 / sizeof(uint64_t);
+  const int pressure_rounds = rounds / 8;
+  uint64_t *pressure = calloc(pressure_count, sizeof(uint64_t));
+
+  start = get_time_ms();
+
+  for (int round = 0; round < pressure_rounds; round++) {
+    for (int i = 0; i < occupancy_count; i++) {
+      uint64_t occupancy = occupancies[i] ^ (uint64_t)round;
+
+      for (int square = 0; square < 64; square++) {
+        checksum += get_rook_attacks(square, occupancy);
+        checksum += get_bishop_attacks(square, occupancy);
+        checksum += pressure[prng_generate_random(&prng) % pressure_count];
+      }
+    }
+  }
+
+  lookups = 2ULL * pressure_rounds * occupancy_count * 64;
+  elapsed = get_time_ms() - start;
+  lookups_per_second = elapsed > 0 ? lookups * 1000 / elapsed : lookups * 1000;
+
+  printf("backend %s with cache pressure: %lu lookups in %d ms, %lu lookups/s "
+         "(checksum %lx)\n",
+         SLIDER_BACKEND, lookups, elapsed, lookups_per_second, checksum);
+  printf("slider tables: %zu KB\n", SLIDER_TABLES_SIZE / 1024);
+
+  free(pressure);
+
+  free(occupancies);
+}
+
+void uci_print_id() {
+  printf("id name Billy's Engine v1.0\n");
+  printf("id author Billy Levin\n");
+  printf("option name Hash type spin default %d min 1 max %d\n",
+         DEFAULT_HASH_MB, MAX_HASH_MB);
+  printf("option name Threads type spin default 1 min 1 max %d\n",
+         MAX_SEARCH_THREADS);
+  printf("uciok\n");
 }
 
 void uci_loop() {
@@ -2926,44 +4185,105 @@ void uci_loop() {
   init_all();
 
   board_t *board = board_new();
+  // one table for the whole session so each move can reuse what the
+  // previous searches learned
+  uci_search_t search = {.running = false,
+                         .tt = transposition_table_new(DEFAULT_HASH_MB),
+                         .thread_count = 1};
 
-  printf("id name Billy's Engine v1.0\n");
-  printf("id author Billy Levin\n");
-  printf("uciok\n");
+  uci_print_id();
 
   while (1) {
     char *input = readline(NULL);
+
+    // treat end of input the same as `quit`
+    if (input == NULL || strncmp(input, "quit", 4) == 0) {
+      uci_stop_search(&search);
+      free(input);
+      break;
+    }
+
     add_history(input);
 
-    if (strncmp(input, "uci", 3) == 0) {
-      printf("id name Billy's Engine v1.0\n");
-      printf("id author Billy Levin\n");
-      printf("uciok\n");
+    if (strncmp(input, "ucinewgame", 10) == 0) {
+      uci_stop_search(&search);
+      transposition_table_clear(search.tt, search.thread_count);
+    } else if (strncmp(input, "uci", 3) == 0) {
+      uci_print_id();
+    } else if (strncmp(input, "setoption", 9) == 0) {
+      uci_stop_search(&search);
+      uci_parse_setoption(input, &search);
+    } else if (strncmp(input, "magicbench", 10) == 0) {
+      uci_stop_search(&search);
+      bench_attack_lookups();
+    } else if (strncmp(input, "smpbench", 8) == 0) {
+      uci_stop_search(&search);
+      int depth = atoi(input + 8);
+      bench_smp_scaling(depth > 0 ? depth : 7);
     } else if (strncmp(input, "isready", 7) == 0) {
       printf("readyok\n");
+    } else if (strncmp(input, "stop", 4) == 0) {
+      uci_stop_search(&search);
     } else if (strncmp(input, "position", 8) == 0) {
+      uci_stop_search(&search);
       uci_parse_position(board, input);
+    } else if (strncmp(input, "bench", 5) == 0) {
+      uci_stop_search(&search);
+      parse_bench(input);
+    } else if (strncmp(input, "perftsuite", 10) == 0) {
+      uci_stop_search(&search);
+      run_perft_suite(search.thread_count);
+    } else if (strncmp(input, "go perft", 8) == 0) {
+      uci_stop_search(&search);
+      perft_test(board, atoi(input + 8), search.thread_count);
     } else if (strncmp(input, "go", 2) == 0) {
-      uci_parse_go(board, input);
+      uci_parse_go(board, input, &search);
     }
+
+    free(input);
   }
+
+  transposition_table_free(search.tt);
+  board_free(board);
 }
 
 void main_loop() {
   while (1) {
     char *input = readline(NULL);
+
+    if (input == NULL || strncmp(input, "quit", 4) == 0) {
+      free(input);
+      break;
+    }
+
     add_history(input);
 
     if (strncmp(input, "uci", 3) == 0) {
+      free(input);
       uci_loop();
       break;
     }
+
+    free(input);
   }
 }
 
-int main() {
+int main(int argc, char **argv) {
+  // `engine bench [depth] [hash] [threads] [json]` runs the bench and exits,
+  // so CI doesn't need to drive the UCI loop
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    char input[256] = "bench";
+
+    for (int i = 2; i < argc; i++) {
+      strncat(input, " ", sizeof(input) - strlen(input) - 1);
+      strncat(input, argv[i], sizeof(input) - strlen(input) - 1);
+    }
+
+    init_all();
+    parse_bench(input);
+    return EXIT_SUCCESS;
+  }
+
   main_loop();
-  // init_all();
-  // run_perft_suite();
   return EXIT_SUCCESS;
 }
@@ -1,20 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-typedef struct {
-  uint64_t magic;
-  size_t table_length;
-} found_magic_t;
-
+// `index_bits` is usually the number of bits in the mask, but a good magic can
+// squeeze the blocker sets into fewer
 typedef struct {
   uint64_t magic;
   uint64_t mask;
-  uint8_t bits_in_mask;
+  uint8_t index_bits;
 } magic_candidate_t;
 
 typedef enum { ROOK, BISHOP } piece_t;
 
+typedef enum { WHITE, BLACK } side_t;
+
+const uint64_t NOT_A_FILE = 18374403900871474942ULL;
+const uint64_t NOT_H_FILE = 9187201950435737471ULL;
+const uint64_t NOT_AB_FILE = 18229723555195321596ULL;
+const uint64_t NOT_GH_FILE = 4557430888798830399ULL;
+
+// the magics the engine is built with and how many index bits each one
+// needs. a plain `magics.out` run prints a fresh set in the same format
+const uint64_t ROOK_MAGICS[64] = {
+    0xa8002c000108020ULL,  0x4440200140003000ULL, 0x8080200010011880ULL,
+    0x380180080141000ULL,  0x1a00060008211044ULL, 0x410001000a0c0008ULL,
+    0x9500060004008100ULL, 0x100024284a20700ULL,  0x802140008000ULL,
+    0x80c01002a00840ULL,   0x402004282011020ULL,  0x9862000820420050ULL,
+    0x1001448011100ULL,    0x6432800200800400ULL, 0x40100010002000cULL,
+    0x2800d0010c080ULL,    0x90c0008000803042ULL, 0x4010004000200041ULL,
+    0x3010010200040ULL,    0xa40828028001000ULL,  0x123010008000430ULL,
+    0x24008004020080ULL,   0x60040001104802ULL,   0x582200028400d1ULL,
+    0x4000802080044000ULL, 0x408208200420308ULL,  0x610038080102000ULL,
+    0x3601000900100020ULL, 0x80080040180ULL,      0xc2020080040080ULL,
+    0x80084400100102ULL,   0x4022408200014401ULL, 0x40052040800082ULL,
+    0xb08200280804000ULL,  0x8a80a008801000ULL,   0x4000480080801000ULL,
+    0x911808800801401ULL,  0x822a003002001894ULL, 0x401068091400108aULL,
+    0x4a10a00004cULL,      0x2000800640008024ULL, 0x1486408102020020ULL,
+    0x100a000d50041ULL,    0x810050020b0020ULL,   0x204000800808004ULL,
+    0x20048100a000cULL,    0x112000831020004ULL,  0x9000040810002ULL,
+    0x440490200208200ULL,  0x8910401000200040ULL, 0x6404200050008480ULL,
+    0x4b824a2010010100ULL, 0x4080801810c0080ULL,  0x400802a0080ULL,
+    0x8224080110026400ULL, 0x40002c4104088200ULL, 0x1002100104a0282ULL,
+    0x1208400811048021ULL, 0x3201014a40d02001ULL, 0x5100019200501ULL,
+    0x101000208001005ULL,  0x2008450080702ULL,    0x1002080301d00cULL,
+    0x410201ce5c030092ULL,
+};
+
+const uint64_t BISHOP_MAGICS[64] = {
+    0x40210414004040ULL,   0x2290100115012200ULL, 0xa240400a6004201ULL,
+    0x80a0420800480ULL,    0x4022021000000061ULL, 0x31012010200000ULL,
+    0x4404421051080068ULL, 0x1040882015000ULL,    0x8048c01206021210ULL,
+    0x222091024088820ULL,  0x4328110102020200ULL, 0x901cc41052000d0ULL,
+    0xa828c20210000200ULL, 0x308419004a004e0ULL,  0x4000840404860881ULL,
+    0x800008424020680ULL,  0x28100040100204a1ULL, 0x82001002080510ULL,
+    0x9008103000204010ULL, 0x141820040c00b000ULL, 0x81010090402022ULL,
+    0x14400480602000ULL,   0x8a008048443c00ULL,   0x280202060220ULL,
+    0x3520100860841100ULL, 0x9810083c02080100ULL, 0x41003000620c0140ULL,
+    0x6100400104010a0ULL,  0x20840000802008ULL,   0x40050a010900a080ULL,
+    0x818404001041602ULL,  0x8040604006010400ULL, 0x1028044001041800ULL,
+    0x80b00828108200ULL,   0xc000280c04080220ULL, 0x3010020080880081ULL,
+    0x10004c0400004100ULL, 0x3010020200002080ULL, 0x202304019004020aULL,
+    0x4208a0000e110ULL,    0x108018410006000ULL,  0x202210120440800ULL,
+    0x100850c828001000ULL, 0x1401024204800800ULL, 0x41028800402ULL,
+    0x20642300480600ULL,   0x20410200800202ULL,   0xca02480845000080ULL,
+    0x140c404a0080410ULL,  0x2180a40108884441ULL, 0x4410420104980302ULL,
+    0x1108040046080000ULL, 0x8141029012020008ULL, 0x894081818082800ULL,
+    0x40020404628000ULL,   0x804100c010c2122ULL,  0x8168210510101200ULL,
+    0x1088148121080ULL,    0x204010100c11010ULL,  0x1814102013841400ULL,
+    0xc00010020602ULL,     0x1045220c040820ULL,   0x12400808070840ULL,
+    0x2004012a040132ULL,
+};
+
+const uint8_t ROOK_INDEX_BITS[64] = {
+    12, 11, 11, 11, 11, 11, 11, 12, 11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11, 11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11, 11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11, 12, 11, 11, 11, 11, 11, 11, 12,
+};
+
+const uint8_t BISHOP_INDEX_BITS[64] = {
+    6, 5, 5, 5, 5, 5, 5, 6, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 7, 7, 7, 7,
+    5, 5, 5, 5, 7, 9, 9, 7, 5, 5, 5, 5, 7, 9, 9, 7, 5, 5, 5, 5, 7, 7,
+    7, 7, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 5, 5, 5, 5, 5, 5, 6,
+};
+
+uint64_t generate_pawn_attack_mask(int square, side_t side) {
+  uint64_t mask = 0ULL;
+  uint64_t bitboard = 1ULL << square;
+
+  if (side == WHITE) {
+    uint64_t east_attacks = (bitboard << 9) & NOT_A_FILE;
+    uint64_t west_attacks = (bitboard << 7) & NOT_H_FILE;
+    mask |= east_attacks;
+    mask |= west_attacks;
+  } else {
+    uint64_t east_attacks = (bitboard >> 7) & NOT_A_FILE;
+    uint64_t west_attacks = (bitboard >> 9) & NOT_H_FILE;
+    mask |= east_attacks;
+    mask |= west_attacks;
+  }
+
+  return mask;
+}
+
+uint64_t generate_knight_attack_mask(int square) {
+  uint64_t mask = 0ULL;
+  uint64_t bitboard = 1ULL << square;
+
+  uint64_t north_north_east = (bitboard << 17) & NOT_A_FILE;
+  mask |= north_north_east;
+
+  uint64_t north_east_east = (bitboard << 10) & NOT_AB_FILE;
+  mask |= north_east_east;
+
+  uint64_t south_east_east = (bitboard >> 6) & NOT_AB_FILE;
+  mask |= south_east_east;
+
+  uint64_t south_south_east = (bitboard >> 15) & NOT_A_FILE;
+  mask |= south_south_east;
+
+  uint64_t north_north_west = (bitboard << 15) & NOT_H_FILE;
+  mask |= north_north_west;
+
+  uint64_t north_west_west = (bitboard << 6) & NOT_GH_FILE;
+  mask |= north_west_west;
+
+  uint64_t south_west_west = (bitboard >> 10) & NOT_GH_FILE;
+  mask |= south_west_west;
+
+  uint64_t south_south_west = (bitboard >> 17) & NOT_H_FILE;
+  mask |= south_south_west;
+
+  return mask;
+}
+
+uint64_t east_one(uint64_t bits) { return (bits << 1) & NOT_A_FILE; }
+uint64_t west_one(uint64_t bits) { return (bits >> 1) & NOT_H_FILE; }
+uint64_t north_one(uint64_t bits) { return bits << 8; }
+uint64_t south_one(uint64_t bits) { return bits >> 8; }
+
+uint64_t generate_king_attack_mask(int square) {
+  uint64_t king_bitboard = 1ULL << square;
+  uint64_t attacks = east_one(king_bitboard) | west_one(king_bitboard);
+  king_bitboard |= attacks;
+  attacks |= north_one(king_bitboard) | south_one(king_bitboard);
+  return attacks;
+}
+
+
 uint64_t generate_rook_blocker_mask(int square) {
   uint64_t mask = 0ULL;
 
@@ -153,19 +293,18 @@ uint64_t generate_bishop_attack_mask(int square, uint64_t blockers) {
   return mask;
 }
 
-// rng stuff taken from
-// https://www.chessprogramming.org/Looking_for_Magics#Feeding_in_Randoms
-uint64_t random_uint64() {
-  uint64_t u1, u2, u3, u4;
-  u1 = (uint64_t)(rand()) & 0xFFFF;
-  u2 = (uint64_t)(rand()) & 0xFFFF;
-  u3 = (uint64_t)(rand()) & 0xFFFF;
-  u4 = (uint64_t)(rand()) & 0xFFFF;
-  return u1 | (u2 << 16) | (u3 << 32) | (u4 << 48);
+// xorshift64*, one state per search thread since `rand()` isn't thread safe
+uint64_t random_uint64(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
 }
 
-uint64_t random_uint64_fewbits() {
-  return random_uint64() & random_uint64() & random_uint64();
+// magics with few set bits are much more likely to work, see
+// https://www.chessprogramming.org/Looking_for_Magics#Feeding_in_Randoms
+uint64_t random_uint64_fewbits(uint64_t *state) {
+  return random_uint64(state) & random_uint64(state) & random_uint64(state);
 }
 
 uint8_t count_bits(uint64_t number) {
@@ -177,36 +316,42 @@ uint8_t count_bits(uint64_t number) {
   return count;
 }
 
+uint64_t blocker_mask(int square, piece_t piece) {
+  return piece == ROOK ? generate_rook_blocker_mask(square)
+                       : generate_bishop_blocker_mask(square);
+}
+
+uint64_t attack_mask(int square, piece_t piece, uint64_t blockers) {
+  return piece == ROOK ? generate_rook_attack_mask(square, blockers)
+                       : generate_bishop_attack_mask(square, blockers);
+}
+
 size_t get_magic_index(magic_candidate_t *candidate,
                        uint64_t current_blockers) {
   uint64_t blockers = current_blockers & candidate->mask;
   uint64_t hash = candidate->magic * blockers;
-  uint8_t shift = 64 - candidate->bits_in_mask;
+  uint8_t shift = 64 - candidate->index_bits;
   return (size_t)(hash >> shift);
 }
 
-size_t check_magic(magic_candidate_t *candidate, int square, piece_t piece) {
-  uint64_t attack_table[1 << candidate->bits_in_mask];
-  size_t attack_table_length = 0;
-
-  for (size_t i = 0; i < (1 << candidate->bits_in_mask); i++) {
-    attack_table[i] = 0ULL;
-  }
+// fills `attack_table`, which has to hold `1 << index_bits` entries, the way
+// `candidate` indexes it. blocker sets may share a slot when they have the
+// same attacks. returns false if two different attack sets collide
+bool check_magic(magic_candidate_t *candidate, int square, piece_t piece,
+                 uint64_t *attack_table) {
+  memset(attack_table, 0,
+         ((size_t)1 << candidate->index_bits) * sizeof(uint64_t));
 
   uint64_t blockers = 0ULL;
 
   while (1) {
-    uint64_t moves = piece == ROOK
-                         ? generate_rook_attack_mask(square, blockers)
-                         : generate_bishop_attack_mask(square, blockers);
-
+    uint64_t moves = attack_mask(square, piece, blockers);
     size_t index = get_magic_index(candidate, blockers);
 
     if (attack_table[index] == 0) {
       attack_table[index] = moves;
-      attack_table_length++;
     } else if (attack_table[index] != moves) {
-      return 0;
+      return false;
     }
 
     blockers = (blockers - candidate->mask) & candidate->mask;
@@ -215,49 +360,274 @@ size_t check_magic(magic_candidate_t *candidate, int square, piece_t piece) {
     }
   }
 
-  return attack_table_length;
+  return true;
+}
+
+double get_time_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// finds a magic at the full mask size first, which never takes long, then
+// spends `seconds` looking for one that needs fewer index bits
+magic_candidate_t find_magic(int square, piece_t piece, double seconds,
+                             uint64_t *state) {
+  magic_candidate_t found = {.mask = blocker_mask(square, piece)};
+  found.index_bits = count_bits(found.mask);
+
+  uint64_t *attack_table =
+      malloc(((size_t)1 << found.index_bits) * sizeof(uint64_t));
+
+  do {
+    found.magic = random_uint64_fewbits(state);
+  } while (!check_magic(&found, square, piece, attack_table));
+
+  magic_candidate_t candidate = found;
+  double deadline = get_time_seconds() + seconds;
+  uint32_t tries = 0;
+
+  // checking the clock every time would cost more than most tries
+  while ((++tries & 1023) != 0 || get_time_seconds() < deadline) {
+    candidate.magic = random_uint64_fewbits(state);
+    candidate.index_bits = found.index_bits - 1;
+
+    if (check_magic(&candidate, square, piece, attack_table)) {
+      found = candidate;
+    }
+  }
+
+  free(attack_table);
+  return found;
+}
+
+typedef struct {
+  piece_t piece;
+  double seconds;
+  magic_candidate_t *found;
+  int *next_square;
+} magic_search_t;
+
+void *magic_search_worker(void *arg) {
+  magic_search_t *search = arg;
+
+  while (1) {
+    int square = __atomic_fetch_add(search->next_square, 1, __ATOMIC_RELAXED);
+
+    if (square >= 64) {
+      break;
+    }
+
+    // seeded per square so a run is repeatable whatever the thread count
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (square + 1) + search->piece;
+    search->found[square] =
+        find_magic(square, search->piece, search->seconds, &state);
+  }
+
+  return NULL;
+}
+
+// squares are handed out to `thread_count` threads, each searching one
+// square at a time. there's nothing for more than 64 of them to do
+void print_magics(piece_t piece, int thread_count, double seconds) {
+  const char *name = piece == ROOK ? "ROOK" : "BISHOP";
+
+  if (thread_count < 1) {
+    thread_count = 1;
+  } else if (thread_count > 64) {
+    thread_count = 64;
+  }
+
+  magic_candidate_t found[64];
+  int next_square = 0;
+  magic_search_t search = {.piece = piece,
+                           .seconds = seconds,
+                           .found = found,
+                           .next_square = &next_square};
+
+  pthread_t threads[64];
+  for (int i = 0; i < thread_count; i++) {
+    pthread_create(&threads[i], NULL, magic_search_worker, &search);
+  }
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("const uint64_t %s_MAGICS[64] = {\n", name);
+  for (int square = 0; square < 64; square++) {
+    printf("    0x%lxULL,\n", found[square].magic);
+  }
+  printf("};\n\n");
+
+  size_t slot_count = 0;
+
+  printf("const uint8_t %s_INDEX_BITS[64] = {\n", name);
+  for (int square = 0; square < 64; square++) {
+    printf("%s%d,%s", square % 16 == 0 ? "    " : " ",
+           found[square].index_bits, square % 16 == 15 ? "\n" : "");
+    slot_count += (size_t)1 << found[square].index_bits;
+  }
+  printf("};\n\n");
+
+  printf("// %s index table: %zu slots\n\n", name, slot_count);
+}
+
+// prints a comma separated run of bitboards, four to a line
+void print_bitboards(const uint64_t *bitboards, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    printf("%s0x%016lxULL,%s", i % 4 == 0 ? "    " : " ", bitboards[i],
+           i % 4 == 3 || i == count - 1 ? "\n" : "");
+  }
+}
+
+magic_candidate_t embedded_magic(int square, piece_t piece) {
+  magic_candidate_t candidate = {
+      .magic = piece == ROOK ? ROOK_MAGICS[square] : BISHOP_MAGICS[square],
+      .mask = blocker_mask(square, piece),
+      .index_bits =
+          piece == ROOK ? ROOK_INDEX_BITS[square] : BISHOP_INDEX_BITS[square]};
+  return candidate;
 }
 
-found_magic_t find_magic(int square, piece_t piece) {
-  uint64_t mask = piece == ROOK ? generate_rook_blocker_mask(square)
-                                : generate_bishop_blocker_mask(square);
+// fills one square's slots in `attacks`, one for every index. the pext index
+// is just the blocker bits packed together, which is the order the
+// carry-rippler visits them in. returns the new length of `attacks`
+size_t fill_square_tables(int square, piece_t piece, bool pext,
+                          uint64_t *attacks, size_t attack_count) {
+  magic_candidate_t candidate = embedded_magic(square, piece);
+  size_t slot_count =
+      (size_t)1 << (pext ? count_bits(candidate.mask) : candidate.index_bits);
 
-  uint8_t bits_in_mask = count_bits(mask);
+  // slots no blocker set hashes to are never read
+  memset(attacks + attack_count, 0, slot_count * sizeof(uint64_t));
 
-  magic_candidate_t magic_candidate = {.magic = 0ULL, mask, bits_in_mask};
+  uint64_t blockers = 0ULL;
+  size_t pext_index = 0;
 
   while (1) {
-    magic_candidate.magic = random_uint64_fewbits();
-    size_t table_length = check_magic(&magic_candidate, square, piece);
+    size_t index = pext ? pext_index : get_magic_index(&candidate, blockers);
+    attacks[attack_count + index] = attack_mask(square, piece, blockers);
+
+    pext_index++;
+    blockers = (blockers - candidate.mask) & candidate.mask;
+    if (blockers == 0) {
+      break;
+    }
+  }
+
+  return attack_count + slot_count;
+}
 
-    if (table_length > 0) {
-      found_magic_t found = {.magic = magic_candidate.magic,
-                             .table_length = table_length};
-      return found;
+// prints one piece's tables for one of the engine's lookups and returns their
+// size in bytes
+size_t print_slider_tables(piece_t piece, bool pext) {
+  const char *name = piece == ROOK ? "ROOK" : "BISHOP";
+
+  uint64_t *attacks = malloc(64 * 4096 * sizeof(uint64_t));
+  uint64_t *magic_table = malloc(4096 * sizeof(uint64_t));
+  size_t attack_offsets[64];
+  size_t attack_count = 0;
+
+  for (int square = 0; square < 64; square++) {
+    magic_candidate_t candidate = embedded_magic(square, piece);
+
+    if (!pext && !check_magic(&candidate, square, piece, magic_table)) {
+      fprintf(stderr, "%s magic for square %d doesn't work\n", name, square);
+      exit(EXIT_FAILURE);
     }
+
+    attack_offsets[square] = attack_count;
+    attack_count = fill_square_tables(square, piece, pext, attacks,
+                                      attack_count);
   }
+
+  printf("const uint64_t %s_ATTACKS[%zu] = {\n", name, attack_count);
+  print_bitboards(attacks, attack_count);
+  printf("};\n\n");
+
+  // pext ignores the magic and shift, it only needs the mask
+  printf("const magic_entry_t %s_MAGIC_ENTRIES[64] = {\n", name);
+  for (int square = 0; square < 64; square++) {
+    magic_candidate_t candidate = embedded_magic(square, piece);
+
+    printf("    {0x%016lxULL, 0x%016lxULL, %s_ATTACKS + %zu, %d},\n",
+           candidate.mask, candidate.magic, name, attack_offsets[square],
+           64 - candidate.index_bits);
+  }
+  printf("};\n\n");
+
+  free(attacks);
+  free(magic_table);
+
+  return attack_count * sizeof(uint64_t);
 }
 
-void print_magics(piece_t piece) {
-  printf("const uint64_t %s_MAGICS[64] = {\n",
-         piece == ROOK ? "ROOK" : "BISHOP");
+// writes every attack table the engine uses as `const` data, so the engine
+// doesn't have to build them at startup. `make` puts this in attack_tables.h
+void print_attack_tables() {
+  uint64_t pawn_attacks[2][64];
+  uint64_t knight_attacks[64];
+  uint64_t king_attacks[64];
 
-  size_t total_size = 0;
   for (int square = 0; square < 64; square++) {
-    found_magic_t found_magic = find_magic(square, piece);
-    printf("  0x%lxULL,\n", found_magic.magic);
-    total_size += found_magic.table_length;
+    pawn_attacks[WHITE][square] = generate_pawn_attack_mask(square, WHITE);
+    pawn_attacks[BLACK][square] = generate_pawn_attack_mask(square, BLACK);
+    knight_attacks[square] = generate_knight_attack_mask(square);
+    king_attacks[square] = generate_king_attack_mask(square);
+  }
+
+  printf("// generated by `magics.out tables`, don't edit\n\n");
+
+  printf("const uint64_t PAWN_ATTACKS[2][64] = {\n");
+  for (int side = WHITE; side <= BLACK; side++) {
+    printf("  {\n");
+    print_bitboards(pawn_attacks[side], 64);
+    printf("  },\n");
   }
+  printf("};\n\n");
+
+  printf("const uint64_t KNIGHT_ATTACKS[64] = {\n");
+  print_bitboards(knight_attacks, 64);
+  printf("};\n\n");
 
+  printf("const uint64_t KING_ATTACKS[64] = {\n");
+  print_bitboards(king_attacks, 64);
   printf("};\n\n");
 
-  printf("const size_t %s_ATTACK_TABLE_SIZE = %zu;\n\n",
-         piece == ROOK ? "ROOK" : "BISHOP", total_size);
+  // the slider tables depend on the lookup the engine is built with
+  for (int pext = 1; pext >= 0; pext--) {
+    printf(pext ? "#ifdef USE_PEXT\n" : "#else\n");
+
+    size_t size =
+        print_slider_tables(ROOK, pext) + print_slider_tables(BISHOP, pext);
+
+    printf("const size_t SLIDER_TABLES_SIZE = %zu;\n", size);
+
+    fprintf(stderr, "%s slider tables: %zu KB\n", pext ? "pext" : "magic",
+            size / 1024);
+  }
+
+  printf("#endif\n");
 }
 
-int main() {
-  print_magics(ROOK);
-  print_magics(BISHOP);
+// `magics.out [threads] [seconds]` searches for a new set of magics, giving
+// each square `seconds` to find one with fewer index bits. `magics.out tables`
+// prints the engine's attack tables for the magics above
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "tables") == 0) {
+    print_attack_tables();
+    return EXIT_SUCCESS;
+  }
+
+  int thread_count = argc > 1 ? atoi(argv[1]) : 0;
+  double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+  if (thread_count <= 0) {
+    thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  print_magics(ROOK, thread_count, seconds);
+  print_magics(BISHOP, thread_count, seconds);
 
   return EXIT_SUCCESS;
 }